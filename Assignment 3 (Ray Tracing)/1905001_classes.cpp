@@ -1,5 +1,19 @@
 #include "1905001_classes.h"
 
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
 // Color
 
 Color::Color(double r, double g, double b) : r(r), g(g), b(b) {}
@@ -155,6 +169,83 @@ std::ostream& operator<<(std::ostream& os, const Vector& v) {
 
 
 
+// Matrix
+
+Matrix::Matrix() {
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++) data[i][j] = (i == j);
+}
+
+Matrix Matrix::operator*(const Matrix& m) const {
+    Matrix result;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            result.data[i][j] = 0;
+            for (int k = 0; k < 4; k++)
+                result.data[i][j] += data[i][k] * m.data[k][j];
+        }
+    }
+    return result;
+}
+
+Matrix Matrix::transpose() const {
+    Matrix result;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++) result.data[i][j] = data[j][i];
+    return result;
+}
+
+Matrix Matrix::inverse() const {
+    // Gauss-Jordan elimination with partial pivoting
+    Matrix a = *this, result;
+    for (int col = 0; col < 4; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < 4; row++)
+            if (fabs(a.data[row][col]) > fabs(a.data[pivot][col])) pivot = row;
+        if (fabs(a.data[pivot][col]) <= 1e-12)
+            throw std::invalid_argument("Matrix is singular");
+        std::swap(a.data[col], a.data[pivot]);
+        std::swap(result.data[col], result.data[pivot]);
+
+        double scale = 1.0 / a.data[col][col];
+        for (int j = 0; j < 4; j++) {
+            a.data[col][j] *= scale;
+            result.data[col][j] *= scale;
+        }
+        for (int row = 0; row < 4; row++) {
+            if (row == col) continue;
+            double factor = a.data[row][col];
+            for (int j = 0; j < 4; j++) {
+                a.data[row][j] -= factor * a.data[col][j];
+                result.data[row][j] -= factor * result.data[col][j];
+            }
+        }
+    }
+    return result;
+}
+
+Vector Matrix::transform_point(const Vector& p) const {
+    double v[4];
+    for (int i = 0; i < 4; i++)
+        v[i] = data[i][0] * p.x + data[i][1] * p.y + data[i][2] * p.z +
+               data[i][3];
+    return Vector(v[0] / v[3], v[1] / v[3], v[2] / v[3]);
+}
+
+Vector Matrix::transform_direction(const Vector& d) const {
+    return Vector(data[0][0] * d.x + data[0][1] * d.y + data[0][2] * d.z,
+                  data[1][0] * d.x + data[1][1] * d.y + data[1][2] * d.z,
+                  data[2][0] * d.x + data[2][1] * d.y + data[2][2] * d.z);
+}
+
+std::istream& operator>>(std::istream& is, Matrix& m) {
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++) is >> m.data[i][j];
+    return is;
+}
+
+
+
 // Camera
 
 Camera::Camera(const Vector& eye, const Vector& look_at,
@@ -253,12 +344,654 @@ Ray::Ray(const Vector& start, const Vector& dir) : origin(start) {
 }
 
 
+
+// View
+
+View::View(const Camera& camera, int width, int height, double view_angle)
+    : camera(camera), width(width), height(height), view_angle(view_angle) {
+    // plane_distance is the distance from the camera to the image plane
+    double plane_distance = 1.0;
+    double window_height = 2 * tan(view_angle * PI / 360.0) * plane_distance;
+    double window_width = window_height * width / height;
+    top_left = camera.pos + plane_distance * camera.look -
+               (window_width / 2.0) * camera.right +
+               (window_height / 2.0) * camera.up;
+    du = window_width / width;
+    dv = window_height / height;
+
+    // Choose middle of the grid cell
+    top_left += 0.5 * du * camera.right - 0.5 * dv * camera.up;
+}
+
+Vector View::pixel_position(int i, int j) const {
+    return top_left + i * du * camera.right - j * dv * camera.up;
+}
+
+Ray View::primary_ray(int i, int j) const {
+    Vector cur_pixel = pixel_position(i, j);
+    return Ray(cur_pixel, cur_pixel - camera.pos);
+}
+
+bool View::project(const Vector& point, double& i, double& j) const {
+    Vector d = point - camera.pos;
+    double depth = d.dot(camera.look);
+    if (depth <= EPS) return false;
+    // where the line to the eye crosses the image plane, at distance 1
+    Vector offset = camera.pos + d / depth - top_left;
+    i = offset.dot(camera.right) / du;
+    j = -offset.dot(camera.up) / dv;
+    return true;
+}
+
+
+
+// Worker Pool
+
+WorkerPool::WorkerPool(unsigned num_threads)
+    : task(nullptr),
+      next_task(0),
+      num_tasks(0),
+      busy_workers(0),
+      generation(0),
+      stopping(false) {
+    num_threads = std::max(1u, num_threads);
+    for (unsigned i = 0; i < num_threads; i++)
+        workers.push_back(std::thread(&WorkerPool::worker_loop, this));
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (std::thread& t : workers) t.join();
+}
+
+int WorkerPool::size() const { return workers.size(); }
+
+void WorkerPool::worker_loop() {
+    unsigned seen_generation = 0;
+    while (true) {
+        const std::function<void(int)>* current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_ready.wait(lock, [&] {
+                return stopping || generation != seen_generation;
+            });
+            if (stopping) return;
+            seen_generation = generation;
+            // woke up only after that round had already finished
+            if (task == nullptr) continue;
+            current = task;
+            busy_workers++;
+        }
+        for (int i = next_task++; i < num_tasks; i = next_task++) (*current)(i);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy_workers--;
+        }
+        work_done.notify_all();
+    }
+}
+
+void WorkerPool::parallel_for(int n, const std::function<void(int)>& task) {
+    std::unique_lock<std::mutex> lock(mutex);
+    this->task = &task;
+    num_tasks = n;
+    next_task = 0;
+    generation++;
+    work_ready.notify_all();
+    // done once every task was handed out and no worker is still on one
+    work_done.wait(lock,
+                   [&] { return next_task >= num_tasks && busy_workers == 0; });
+    this->task = nullptr;
+}
+
+
+
+// AABB
+
+AABB::AABB() : lo(1e18, 1e18, 1e18), hi(-1e18, -1e18, -1e18) {}
+
+AABB::AABB(const Vector& lo, const Vector& hi) : lo(lo), hi(hi) {}
+
+AABB AABB::infinite() {
+    double inf = std::numeric_limits<double>::infinity();
+    return AABB(Vector(-inf, -inf, -inf), Vector(inf, inf, inf));
+}
+
+void AABB::expand(const Vector& p) {
+    lo = Vector(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+    hi = Vector(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+}
+
+void AABB::expand(const AABB& box) {
+    expand(box.lo);
+    expand(box.hi);
+}
+
+void AABB::pad(double amount) {
+    lo -= Vector(amount, amount, amount);
+    hi += Vector(amount, amount, amount);
+}
+
+bool AABB::is_finite() const {
+    return std::isfinite(lo.x) && std::isfinite(lo.y) && std::isfinite(lo.z) &&
+           std::isfinite(hi.x) && std::isfinite(hi.y) && std::isfinite(hi.z);
+}
+
+bool AABB::is_empty() const {
+    return lo.x > hi.x || lo.y > hi.y || lo.z > hi.z;
+}
+
+Vector AABB::centroid() const { return (lo + hi) * 0.5; }
+
+double AABB::surface_area() const {
+    Vector d = hi - lo;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+bool AABB::intersects(const Ray& ray, double t_max) const {
+    // slab test, kept inclusive so that flat boxes (e.g. the floor) still hit
+    double t_near = 0, t_far = t_max;
+    const double origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const double dir[3] = {ray.dir.x, ray.dir.y, ray.dir.z};
+    const double box_lo[3] = {lo.x, lo.y, lo.z};
+    const double box_hi[3] = {hi.x, hi.y, hi.z};
+    for (int axis = 0; axis < 3; axis++) {
+        if (fabs(dir[axis]) < 1e-12) {
+            if (origin[axis] < box_lo[axis] || origin[axis] > box_hi[axis])
+                return false;
+            continue;
+        }
+        double inv = 1.0 / dir[axis];
+        double t0 = (box_lo[axis] - origin[axis]) * inv;
+        double t1 = (box_hi[axis] - origin[axis]) * inv;
+        if (t0 > t1) std::swap(t0, t1);
+        t_near = std::max(t_near, t0);
+        t_far = std::min(t_far, t1);
+        if (t_near > t_far) return false;
+    }
+    return true;
+}
+
+Frustum::Frustum(const View& view, int start_col, int start_row, int end_col,
+                 int end_row, double far_distance) {
+    const Camera& camera = view.camera;
+    // corners of the block, on the outer edges of its border pixels
+    auto corner = [&](double i, double j) {
+        return view.top_left + i * view.du * camera.right -
+               j * view.dv * camera.up - camera.pos;
+    };
+    Vector top_left = corner(start_col - 0.5, start_row - 0.5);
+    Vector top_right = corner(end_col - 0.5, start_row - 0.5);
+    Vector bottom_left = corner(start_col - 0.5, end_row - 0.5);
+    Vector bottom_right = corner(end_col - 0.5, end_row - 0.5);
+    Vector centre = (top_left + bottom_right) * 0.5;
+
+    Vector sides[4] = {
+        top_left.cross(bottom_left), bottom_left.cross(bottom_right),
+        bottom_right.cross(top_right), top_right.cross(top_left)};
+    for (int k = 0; k < 4; k++) {
+        normals[k] = centre.dot(sides[k]) < 0 ? -sides[k] : sides[k];
+        offsets[k] = normals[k].dot(camera.pos);
+    }
+    normals[4] = camera.look;
+    offsets[4] = camera.look.dot(camera.pos);
+    normals[5] = -camera.look;
+    offsets[5] = -camera.look.dot(camera.pos) - far_distance;
+}
+
+bool Frustum::intersects(const AABB& box) const {
+    if (!box.is_finite()) return true;
+    for (int k = 0; k < 6; k++) {
+        // the corner of the box farthest along the normal
+        const Vector& n = normals[k];
+        Vector p(n.x >= 0 ? box.hi.x : box.lo.x, n.y >= 0 ? box.hi.y : box.lo.y,
+                 n.z >= 0 ? box.hi.z : box.lo.z);
+        if (n.dot(p) < offsets[k]) return false;
+    }
+    return true;
+}
+
+
+
+// BVH
+
+void BVH::clear() {
+    nodes.clear();
+    indices.clear();
+    unbounded.clear();
+    parents.clear();
+    leaves.clear();
+}
+
+size_t BVH::memory_used() const {
+    return nodes.capacity() * sizeof(BVHNode) +
+           (indices.capacity() + unbounded.capacity() + parents.capacity() +
+            leaves.capacity()) *
+               sizeof(int32_t);
+}
+
+void BVH::build(const std::vector<AABB>& boxes, int max_leaf_size) {
+    clear();
+    this->max_leaf_size = max_leaf_size;
+    std::vector<Vector> centroids(boxes.size());
+    for (int i = 0; i < boxes.size(); i++) {
+        if (boxes[i].is_empty()) continue;
+        if (boxes[i].is_finite()) {
+            indices.push_back(i);
+            centroids[i] = boxes[i].centroid();
+        } else {
+            unbounded.push_back(i);
+        }
+    }
+    if (!indices.empty()) build_node(boxes, centroids, 0, indices.size());
+}
+
+int BVH::build_node(const std::vector<AABB>& boxes,
+                    std::vector<Vector>& centroids, int begin, int end) {
+    int node_idx = nodes.size();
+    nodes.push_back(BVHNode());
+
+    AABB box, centroid_box;
+    for (int i = begin; i < end; i++) {
+        box.expand(boxes[indices[i]]);
+        centroid_box.expand(centroids[indices[i]]);
+    }
+    // keep a little slack so that rounding in the slab test never culls a
+    // primitive whose own intersection routine reports a hit
+    box.pad(1e-4);
+    nodes[node_idx].box = box;
+
+    if (end - begin <= max_leaf_size) {
+        nodes[node_idx].start = begin;
+        nodes[node_idx].count = end - begin;
+        return node_idx;
+    }
+
+    // median split along the axis with the widest centroid spread
+    Vector extent = centroid_box.hi - centroid_box.lo;
+    int axis = 0;
+    if (extent.y > extent.x) axis = 1;
+    if (extent.z > (axis == 0 ? extent.x : extent.y)) axis = 2;
+    auto key = [&](int32_t idx) {
+        const Vector& c = centroids[idx];
+        return axis == 0 ? c.x : (axis == 1 ? c.y : c.z);
+    };
+    int mid = (begin + end) / 2;
+    std::nth_element(indices.begin() + begin, indices.begin() + mid,
+                     indices.begin() + end,
+                     [&](int32_t a, int32_t b) { return key(a) < key(b); });
+
+    build_node(boxes, centroids, begin, mid);
+    int right = build_node(boxes, centroids, mid, end);
+    nodes[node_idx].start = right;
+    nodes[node_idx].count = 0;
+    return node_idx;
+}
+
+bool BVH::refit(const std::vector<AABB>& boxes,
+                const std::vector<int>& changed, double max_degradation) {
+    if (parents.size() != nodes.size() || leaves.size() != boxes.size()) {
+        parents.assign(nodes.size(), -1);
+        leaves.assign(boxes.size(), -1);
+        area_sum = 0;
+        for (int i = 0; i < nodes.size(); i++) {
+            const BVHNode& node = nodes[i];
+            area_sum += node.box.surface_area();
+            if (node.count > 0) {
+                for (int k = node.start; k < node.start + node.count; k++)
+                    leaves[indices[k]] = i;
+            } else {
+                parents[i + 1] = parents[node.start] = i;
+            }
+        }
+        if (!nodes.empty())
+            built_cost = area_sum / nodes[0].box.surface_area();
+    }
+
+    // children come after their parent, so taking the highest node first
+    // updates both children of a node before the node itself
+    std::priority_queue<int> pending;
+    for (int idx : changed) {
+        if (boxes[idx].is_empty()) {
+            if (leaves[idx] != -1) return false;
+            continue;
+        }
+        if ((leaves[idx] == -1) != !boxes[idx].is_finite()) return false;
+        if (leaves[idx] != -1) pending.push(leaves[idx]);
+    }
+    while (!pending.empty()) {
+        int node_idx = pending.top();
+        while (!pending.empty() && pending.top() == node_idx) pending.pop();
+        BVHNode& node = nodes[node_idx];
+        AABB box;
+        if (node.count > 0) {
+            for (int k = node.start; k < node.start + node.count; k++)
+                box.expand(boxes[indices[k]]);
+            box.pad(1e-4);
+        } else {
+            box.expand(nodes[node_idx + 1].box);
+            box.expand(nodes[node.start].box);
+        }
+        if (box.lo.x == node.box.lo.x && box.lo.y == node.box.lo.y &&
+            box.lo.z == node.box.lo.z && box.hi.x == node.box.hi.x &&
+            box.hi.y == node.box.hi.y && box.hi.z == node.box.hi.z)
+            continue;
+        area_sum += box.surface_area() - node.box.surface_area();
+        node.box = box;
+        if (parents[node_idx] != -1) pending.push(parents[node_idx]);
+    }
+
+    // relative to the root, so that the scene as a whole spreading out does
+    // not count
+    if (nodes.empty()) return true;
+    return area_sum / nodes[0].box.surface_area() <=
+           built_cost * max_degradation;
+}
+
+std::vector<int> cull_objects(const Frustum& frustum,
+                              const std::vector<AABB>& bounds) {
+    std::vector<int> candidates;
+    for (int k = 0; k < bounds.size(); k++)
+        if (!bounds[k].is_empty() && frustum.intersects(bounds[k]))
+            candidates.push_back(k);
+    return candidates;
+}
+
+
+// SphereSet
+
+namespace {
+
+// The few operations intersect_block needs, on as many doubles at a time as
+// the build's instruction set allows; select(mask, a, b) takes a where the
+// mask is set and b elsewhere
+namespace simd {
+#if defined(__AVX__)
+typedef __m256d Pack;
+const int width = 4;
+inline Pack splat(double v) { return _mm256_set1_pd(v); }
+inline Pack load(const double* p) { return _mm256_loadu_pd(p); }
+inline void store(double* p, Pack v) { _mm256_storeu_pd(p, v); }
+inline Pack add(Pack a, Pack b) { return _mm256_add_pd(a, b); }
+inline Pack sub(Pack a, Pack b) { return _mm256_sub_pd(a, b); }
+inline Pack mul(Pack a, Pack b) { return _mm256_mul_pd(a, b); }
+inline Pack div(Pack a, Pack b) { return _mm256_div_pd(a, b); }
+inline Pack neg(Pack a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+inline Pack sqrt(Pack a) { return _mm256_sqrt_pd(a); }
+inline Pack min(Pack a, Pack b) { return _mm256_min_pd(a, b); }
+inline Pack ge(Pack a, Pack b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+inline Pack gt(Pack a, Pack b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+inline Pack both(Pack a, Pack b) { return _mm256_and_pd(a, b); }
+inline Pack select(Pack mask, Pack a, Pack b) {
+    return _mm256_blendv_pd(b, a, mask);
+}
+inline double min_lane(Pack v) {
+    __m128d m = _mm_min_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_min_sd(m, _mm_unpackhi_pd(m, m)));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+typedef __m128d Pack;
+const int width = 2;
+inline Pack splat(double v) { return _mm_set1_pd(v); }
+inline Pack load(const double* p) { return _mm_loadu_pd(p); }
+inline void store(double* p, Pack v) { _mm_storeu_pd(p, v); }
+inline Pack add(Pack a, Pack b) { return _mm_add_pd(a, b); }
+inline Pack sub(Pack a, Pack b) { return _mm_sub_pd(a, b); }
+inline Pack mul(Pack a, Pack b) { return _mm_mul_pd(a, b); }
+inline Pack div(Pack a, Pack b) { return _mm_div_pd(a, b); }
+inline Pack neg(Pack a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+inline Pack sqrt(Pack a) { return _mm_sqrt_pd(a); }
+inline Pack min(Pack a, Pack b) { return _mm_min_pd(a, b); }
+inline Pack ge(Pack a, Pack b) { return _mm_cmpge_pd(a, b); }
+inline Pack gt(Pack a, Pack b) { return _mm_cmpgt_pd(a, b); }
+inline Pack both(Pack a, Pack b) { return _mm_and_pd(a, b); }
+inline Pack select(Pack mask, Pack a, Pack b) {
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+inline double min_lane(Pack v) {
+    return _mm_cvtsd_f64(_mm_min_sd(v, _mm_unpackhi_pd(v, v)));
+}
+#else
+// one lane, masks being 1 or 0
+typedef double Pack;
+const int width = 1;
+inline Pack splat(double v) { return v; }
+inline Pack load(const double* p) { return *p; }
+inline void store(double* p, Pack v) { *p = v; }
+inline Pack add(Pack a, Pack b) { return a + b; }
+inline Pack sub(Pack a, Pack b) { return a - b; }
+inline Pack mul(Pack a, Pack b) { return a * b; }
+inline Pack div(Pack a, Pack b) { return a / b; }
+inline Pack neg(Pack a) { return -a; }
+inline Pack sqrt(Pack a) { return std::sqrt(a); }
+inline Pack min(Pack a, Pack b) { return b < a ? b : a; }
+inline Pack ge(Pack a, Pack b) { return a >= b; }
+inline Pack gt(Pack a, Pack b) { return a > b; }
+inline Pack both(Pack a, Pack b) { return a != 0 && b != 0; }
+inline Pack select(Pack mask, Pack a, Pack b) { return mask != 0 ? a : b; }
+inline double min_lane(Pack v) { return v; }
+#endif
+}  // namespace simd
+
+static_assert(SphereSet::lanes % simd::width == 0,
+              "a block has to fill whole packs");
+
+// the t of the ray for every lane of the block, as
+// Sphere::find_ray_intersection gives it, or infinity where that is not above
+// t_lo; returns the smallest
+double intersect_block(const SphereSet::Block& block, const Ray& ray,
+                       double t_lo, double t[SphereSet::lanes]) {
+    using namespace simd;
+    const Pack origin_x = splat(ray.origin.x), origin_y = splat(ray.origin.y),
+               origin_z = splat(ray.origin.z);
+    const Pack dir_x = splat(ray.dir.x), dir_y = splat(ray.dir.y),
+               dir_z = splat(ray.dir.z);
+    const Pack zero = splat(0), two = splat(2), four = splat(4),
+               lo = splat(t_lo),
+               none = splat(std::numeric_limits<double>::infinity());
+    Pack nearest = none;
+    for (int k = 0; k < SphereSet::lanes; k += width) {
+        // from the centre to the ray's origin
+        Pack x = sub(origin_x, load(block.x + k));
+        Pack y = sub(origin_y, load(block.y + k));
+        Pack z = sub(origin_z, load(block.z + k));
+        Pack dot = add(add(mul(dir_x, x), mul(dir_y, y)), mul(dir_z, z));
+        Pack b = mul(two, dot);
+        Pack c = sub(add(add(mul(x, x), mul(y, y)), mul(z, z)),
+                     load(block.radius2 + k));
+        Pack discriminant = sub(mul(b, b), mul(four, c));
+        Pack root = sqrt(discriminant);
+        Pack t_minus = div(sub(neg(b), root), two);
+        Pack t_plus = div(add(neg(b), root), two);
+        // the nearer root, unless it is behind the origin
+        Pack lane_t = select(ge(t_minus, zero), t_minus, t_plus);
+        Pack hit = both(ge(discriminant, zero), gt(lane_t, lo));
+        lane_t = select(hit, lane_t, none);
+        store(t + k, lane_t);
+        nearest = min(nearest, lane_t);
+    }
+    return min_lane(nearest);
+}
+
+void fill_lane(SphereSet::Block& block, int lane, int object, const Object* o) {
+    ObjectRecord record;
+    o->get_geometry(record);
+    block.x[lane] = record.params[0];
+    block.y[lane] = record.params[1];
+    block.z[lane] = record.params[2];
+    block.radius2[lane] = record.params[3] * record.params[3];
+    block.objects[lane] = object;
+}
+
+AABB block_box(const SphereSet::Block& block,
+               const std::vector<Object*>& objects) {
+    AABB box;
+    for (int lane = 0; lane < SphereSet::lanes; lane++)
+        if (block.objects[lane] != -1)
+            box.expand(objects[block.objects[lane]]->get_bounds());
+    return box;
+}
+
+}  // namespace
+
+void SphereSet::build(const std::vector<Object*>& objects, int min_spheres) {
+    clear();
+    std::vector<int> spheres;
+    std::vector<AABB> boxes;
+    for (int k = 0; k < objects.size(); k++) {
+        ObjectRecord record;
+        objects[k]->get_geometry(record);
+        AABB box = objects[k]->get_bounds();
+        if (record.type != ObjectRecord::SPHERE || !box.is_finite()) continue;
+        spheres.push_back(k);
+        boxes.push_back(box);
+    }
+    if (spheres.empty() || spheres.size() < min_spheres) return;
+
+    // the leaves of a BVH over the spheres are groups of nearby ones
+    BVH grouping;
+    grouping.build(boxes, lanes);
+    slots.assign(objects.size(), -1);
+    for (const BVHNode& node : grouping.nodes) {
+        if (node.count == 0) continue;
+        Block block;
+        for (int lane = 0; lane < lanes; lane++) {
+            block.x[lane] = block.y[lane] = block.z[lane] = 0;
+            block.radius2[lane] = std::numeric_limits<double>::quiet_NaN();
+            block.objects[lane] = -1;
+        }
+        for (int lane = 0; lane < node.count; lane++) {
+            int k = spheres[grouping.indices[node.start + lane]];
+            fill_lane(block, lane, k, objects[k]);
+            slots[k] = blocks.size() * lanes + lane;
+        }
+        blocks.push_back(block);
+        block_bounds.push_back(block_box(block, objects));
+    }
+    bvh.build(block_bounds, 1);
+}
+
+void SphereSet::clear() {
+    blocks.clear();
+    slots.clear();
+    block_bounds.clear();
+    bvh.clear();
+}
+
+bool SphereSet::contains(int object) const {
+    return object < slots.size() && slots[object] != -1;
+}
+
+void SphereSet::update(const std::vector<Object*>& objects,
+                       const std::vector<int>& changed,
+                       double max_degradation) {
+    std::vector<int> changed_blocks;
+    for (int k : changed) {
+        if (!contains(k)) continue;
+        Block& block = blocks[slots[k] / lanes];
+        fill_lane(block, slots[k] % lanes, k, objects[k]);
+        changed_blocks.push_back(slots[k] / lanes);
+    }
+    if (changed_blocks.empty()) return;
+    for (int b : changed_blocks)
+        block_bounds[b] = block_box(blocks[b], objects);
+    if (!bvh.refit(block_bounds, changed_blocks, max_degradation))
+        build(objects, 0);
+}
+
+size_t SphereSet::memory_used() const {
+    return blocks.capacity() * sizeof(Block) +
+           slots.capacity() * sizeof(int32_t) +
+           block_bounds.capacity() * sizeof(AABB) + bvh.memory_used();
+}
+
+void SphereSet::find_nearest(const Ray& ray, double& t_min,
+                             int& nearest_idx) const {
+    bvh.traverse(ray, t_min, [&](int b) {
+        double t[lanes];
+        double block_t = intersect_block(blocks[b], ray, 0, t);
+        if (block_t > t_min) return false;
+        // ties go to the object listed first in the scene file
+        int idx = -1;
+        for (int lane = 0; lane < lanes; lane++) {
+            int k = blocks[b].objects[lane];
+            if (t[lane] == block_t && (idx == -1 || k < idx)) idx = k;
+        }
+        if (block_t < t_min || idx < nearest_idx) {
+            t_min = block_t;
+            nearest_idx = idx;
+        }
+        return false;
+    });
+}
+
+bool SphereSet::is_obscured(const Ray& ray, double t_cur) const {
+    bool obscured = false;
+    bvh.traverse(ray, t_cur, [&](int b) {
+        double t[lanes];
+        obscured = intersect_block(blocks[b], ray, EPS, t) + EPS < t_cur;
+        return obscured;
+    });
+    return obscured;
+}
+
+
 // Object
 
-Object::Object(const Vector& ref) : reference_point(ref) {}
+Object::Object(const Vector& ref)
+    : reference_point(ref),
+      red_refractive_index(1),
+      green_refractive_index(1),
+      blue_refractive_index(1),
+      shade_kernel(&Object::shade_with<true, true, true>) {}
 
 Color Object::get_color_at(const Vector& pt) const { return color; }
 
+AABB Object::get_bounds() const { return AABB::infinite(); }
+
+bool Object::translate(const Vector& offset) { return false; }
+
+bool Object::tessellate(std::vector<Vector>& triangles, double& error) const {
+    return false;
+}
+
+bool Object::is_convex() const { return false; }
+
+void Object::precompute_primary(const Vector& eye, PrimaryTerms& terms) const {}
+
+double Object::find_primary_intersection(const Ray& ray, double eye_distance,
+                                         const PrimaryTerms& terms) const {
+    return find_ray_intersection(ray);
+}
+
+MaterialRecord Object::get_material() const {
+    MaterialRecord m;
+    m.color[0] = color.r, m.color[1] = color.g, m.color[2] = color.b;
+    m.ambient = phong_coefficients.ambient;
+    m.diffuse = phong_coefficients.diffuse;
+    m.specular = phong_coefficients.specular;
+    m.reflection = phong_coefficients.reflection;
+    m.shine = phong_coefficients.shine;
+    m.padding = 0;
+    m.refractive_indices[0] = red_refractive_index;
+    m.refractive_indices[1] = green_refractive_index;
+    m.refractive_indices[2] = blue_refractive_index;
+    return m;
+}
+
+void Object::set_material(const MaterialRecord& m) {
+    set_color(m.color[0], m.color[1], m.color[2]);
+    set_shine(m.shine);
+    set_coefficients(m.ambient, m.diffuse, m.specular, m.reflection);
+    set_refractive_indices(m.refractive_indices[0], m.refractive_indices[1],
+                           m.refractive_indices[2]);
+}
+
 void Object::set_color(double r, double g, double b) { color = Color(r, g, b); }
 
 void Object::set_shine(int shine) { phong_coefficients.shine = shine; }
@@ -274,21 +1007,11 @@ Vector Object::get_reflection(const Vector& normal,
     return incident - normal * 2 * incident.dot(normal);
 }
 
-int Object::get_next_reflection_object(Ray reflected_ray) const {
+int Object::get_next_reflection_object(const Scene& scene,
+                                       Ray reflected_ray) const {
     // returns the index of the nearest object that the reflected ray intersects
-    int nearest_idx = -1;
-    double t_min_reflection = 1e9;
-
-    for (int k = 0; k < objects.size(); k++) {
-        Object* o = objects[k];
-        double t = o->find_ray_intersection(reflected_ray);
-        if (t > 0 && t < t_min_reflection) {
-            t_min_reflection = t;
-            nearest_idx = k;
-        }
-    }
-
-    return nearest_idx;
+    double t_min_reflection;
+    return scene.find_nearest_object(reflected_ray, t_min_reflection);
 }
 
 Vector Object::get_refraction(const Vector& normal, const Vector& incident,
@@ -305,7 +1028,86 @@ void Object::set_refractive_indices(double r, double g, double b) {
     blue_refractive_index = b;
 }
 
-void Object::shade(const Ray& ray, Color& color, int level) const {
+namespace {
+
+// false if no point of the box can get light from the light: outside a spot
+// light's cone, or farther than range (0 for no limit)
+bool light_reaches(const LightSource& light, const AABB& box, double range) {
+    if (!box.is_finite()) return true;
+    const Vector& p = light.light_position;
+    Vector nearest(std::min(std::max(p.x, box.lo.x), box.hi.x),
+                   std::min(std::max(p.y, box.lo.y), box.hi.y),
+                   std::min(std::max(p.z, box.lo.z), box.hi.z));
+    if (range > 0 && (nearest - p).norm() > range) return false;
+    if (light.type != LightSource::SPOT) return true;
+
+    // the cone meets the box if it meets the sphere around it: the angle off
+    // the axis to the sphere's center, less the angle the sphere spans, is
+    // within the cutoff
+    const SpotLight& spot = (const SpotLight&)light;
+    Vector to_center = box.centroid() - p;
+    double center_distance = to_center.norm();
+    double radius = (box.hi - box.lo).norm() / 2;
+    if (center_distance <= radius) return true;
+    double cos_center = std::min(
+        1.0, std::max(-1.0, to_center.dot(spot.light_direction) /
+                                center_distance));
+    double spanned = asin(radius / center_distance);
+    return acos(cos_center) - spanned < acos(spot.cos_cutoff) + EPS;
+}
+
+}  // namespace
+
+void Object::select_shading(const Scene& scene) {
+    lights.clear();
+    bool spot_lights = false;
+    AABB box = get_bounds();
+    for (size_t l = 0; l < scene.light_sources.size(); l++) {
+        const LightSource& light = *scene.light_sources[l];
+        if (!light_reaches(light, box, scene.light_range)) continue;
+        lights.push_back(l);
+        if (light.type == LightSource::SPOT) spot_lights = true;
+    }
+
+    static const ShadeKernel kernels[2][2][2] = {
+        {{&Object::shade_with<false, false, false>,
+          &Object::shade_with<false, false, true>},
+         {&Object::shade_with<false, true, false>,
+          &Object::shade_with<false, true, true>}},
+        {{&Object::shade_with<true, false, false>,
+          &Object::shade_with<true, false, true>},
+         {&Object::shade_with<true, true, false>,
+          &Object::shade_with<true, true, true>}}};
+    bool specular = phong_coefficients.specular != 0;
+    bool reflection = phong_coefficients.reflection != 0;
+    shade_kernel = kernels[specular][reflection][spot_lights];
+}
+
+void Object::shade(const Scene& scene, const Ray& ray, Color& color,
+                   int level) const {
+    (this->*shade_kernel)(scene, ray, color, level);
+}
+
+namespace {
+
+// pow for the integer shine, by repeated squaring
+double integer_power(double base, int exponent) {
+    bool negative = exponent < 0;
+    unsigned int n = negative ? -(unsigned int)exponent : exponent;
+    double result = 1;
+    while (n) {
+        if (n & 1) result *= base;
+        base *= base;
+        n >>= 1;
+    }
+    return negative ? 1 / result : result;
+}
+
+}  // namespace
+
+template <bool Specular, bool Reflection, bool SpotLights>
+void Object::shade_with(const Scene& scene, const Ray& ray, Color& color,
+                        int level) const {
     double t_intersect = find_ray_intersection(ray);
     if (level == 0 || t_intersect < 0) return;
 
@@ -320,66 +1122,26 @@ void Object::shade(const Ray& ray, Color& color, int level) const {
     if (ray.dir.dot(surface_normal) > 0) surface_normal = -surface_normal;
 
     // Both types of light sources
-    for (LightSource* ls : light_sources) {
-        Ray light_ray(ls->light_position,
-                      intersection_point - ls->light_position);
-
-        double beta;  // for spot light intensity
-        if (ls->type == LightSource::SPOT) {
-            // Continue with spot light unless the ray cast from light_position
-            // to intersection_point exceeds the cutoff angle
-            SpotLight* sls = (SpotLight*)ls;
-            double dot = light_ray.dir.dot(sls->light_direction);
-            double angle = acos(dot / (light_ray.dir.norm() *
-                                       sls->light_direction.norm())) *
-                           180.0 / PI;
-            beta = fabs(angle * PI / 180);
-            if (fabs(angle) >= sls->cutoff_angle) continue;
-        }
+    for (int l : lights) {
+        LightTerm term;
+        if (!light_term<Specular, SpotLights>(
+                *scene.light_sources[l], intersection_point, surface_normal,
+                ray, object_local_color, scene.light_range, term))
+            continue;
 
         // Check if this ray is obscured by any other object
         // i.e. if this light ray reaches any other object before the current
         // one
-        double t_cur = (intersection_point - ls->light_position).norm();
-        if (t_cur < EPS) continue;  // light source is at the intersection point
-
-        bool obscured = false;
-        for (Object* obj : objects) {
-            double t = obj->find_ray_intersection(light_ray);
-            if (t > EPS && t + EPS < t_cur) {
-                obscured = true;
-                break;
-            }
-        }
-        if (obscured) continue;
+        if (scene.is_shadowed(l, this, intersection_point, surface_normal,
+                              term.light_ray, term.t_cur))
+            continue;
 
         // The light ray is not obscured by any other object
-
-        // Diffuse Component
-        // Calculate Lambert value using the surface normal and light ray
-        double lambert_value =
-            std::max(0.0, surface_normal.dot(-light_ray.dir));
-
-        if (lambert_value < EPS) continue;
-
-        double epsilon = 2;
-        color += ls->color * phong_coefficients.diffuse * lambert_value *
-                 object_local_color *
-                 (ls->type == LightSource::SPOT ? pow(cos(beta), epsilon) : 1);
-
-        // Specular Component
-        // Find reflected ray for the light ray
-        Ray reflected_ray(intersection_point,
-                          get_reflection(surface_normal, light_ray.dir));
-        // Calculate Phong value using the reflected ray and the view ray
-        double phong_value = std::max(0.0, reflected_ray.dir.dot(-ray.dir));
-        color += ls->color * phong_coefficients.specular *
-                 pow(phong_value, phong_coefficients.shine) *
-                 object_local_color *
-                 (ls->type == LightSource::SPOT ? pow(cos(beta), epsilon) : 1);
+        color += term.diffuse;
+        if (Specular) color += term.specular;
     }
 
-    if (level == 0) return;
+    if (!Reflection) return;
 
     // Recursive Reflection
     Ray reflected_ray(intersection_point,
@@ -388,14 +1150,102 @@ void Object::shade(const Ray& ray, Color& color, int level) const {
     reflected_ray.origin +=
         reflected_ray.dir * EPS;  // To avoid self-reflection
 
-    int next_reflection_object_idx = get_next_reflection_object(reflected_ray);
+    int next_reflection_object_idx =
+        get_next_reflection_object(scene, reflected_ray);
     if (next_reflection_object_idx == -1) return;
 
     Color reflected_color(0, 0, 0);
-    objects[next_reflection_object_idx]->shade(reflected_ray, reflected_color,
-                                               level - 1);
+    scene.objects[next_reflection_object_idx]->shade(
+        scene, reflected_ray, reflected_color, level - 1);
     color += reflected_color * phong_coefficients.reflection;
-    return;
+}
+
+template <bool Specular, bool SpotLights>
+bool Object::light_term(const LightSource& light, const Vector& point,
+                        const Vector& normal, const Ray& ray,
+                        const Color& local_color, double range,
+                        LightTerm& term) const {
+    term.light_ray = Ray(light.light_position, point - light.light_position);
+
+    // the spot light intensity, cos(beta)^2 for the angle beta off the
+    // spot's axis
+    double spot_factor = 1;
+    if (SpotLights && light.type == LightSource::SPOT) {
+        // Continue with spot light unless the ray cast from light_position
+        // to intersection_point exceeds the cutoff angle; both directions
+        // are unit vectors, so their dot product is cos(beta)
+        const SpotLight& spot = (const SpotLight&)light;
+        double cos_beta = term.light_ray.dir.dot(spot.light_direction);
+        if (cos_beta <= spot.cos_cutoff) return false;
+        spot_factor = cos_beta * cos_beta;
+    }
+
+    term.t_cur = (point - light.light_position).norm();
+    // light source is at the intersection point
+    if (term.t_cur < EPS) return false;
+    if (range > 0 && term.t_cur > range) return false;
+
+    // Diffuse Component
+    // Calculate Lambert value using the surface normal and light ray
+    double lambert_value = std::max(0.0, normal.dot(-term.light_ray.dir));
+    if (lambert_value < EPS) return false;
+    term.diffuse = light.color * phong_coefficients.diffuse * lambert_value *
+                   local_color * spot_factor;
+
+    if (!Specular) return true;
+
+    // Specular Component
+    // Find reflected ray for the light ray
+    Vector reflected_dir =
+        get_reflection(normal, term.light_ray.dir).normalize();
+    // Calculate Phong value using the reflected ray and the view ray
+    double phong_value = std::max(0.0, reflected_dir.dot(-ray.dir));
+    term.specular = light.color * phong_coefficients.specular *
+                    integer_power(phong_value, phong_coefficients.shine) *
+                    local_color * spot_factor;
+    return true;
+}
+
+bool Object::shade_hit(const Scene& scene, const Ray& ray, int level,
+                       HitShading& shading) const {
+    double t_intersect = find_ray_intersection(ray);
+    if (level == 0 || t_intersect < 0) return false;
+
+    shading.point = ray.origin + ray.dir * t_intersect;
+    Color object_local_color = get_color_at(shading.point);
+    shading.ambient = object_local_color * phong_coefficients.ambient;
+    shading.normal = get_normal(shading.point);
+    if (ray.dir.dot(shading.normal) > 0) shading.normal = -shading.normal;
+
+    // the generic kernel gives the same terms when the scene has no spot
+    // lights
+    bool specular = phong_coefficients.specular != 0;
+    shading.lights.clear();
+    for (int l : lights) {
+        const LightSource& light = *scene.light_sources[l];
+        LightTerm term;
+        bool reaches =
+            specular ? light_term<true, true>(light, shading.point,
+                                              shading.normal, ray,
+                                              object_local_color,
+                                              scene.light_range, term)
+                     : light_term<false, true>(light, shading.point,
+                                               shading.normal, ray,
+                                               object_local_color,
+                                               scene.light_range, term);
+        if (!reaches) continue;
+        term.light = l;
+        shading.lights.push_back(term);
+    }
+
+    shading.reflection = phong_coefficients.reflection;
+    if (shading.reflection != 0) {
+        shading.reflected_ray = Ray(shading.point,
+                                    get_reflection(shading.normal, ray.dir));
+        // To avoid self-reflection
+        shading.reflected_ray.origin += shading.reflected_ray.dir * EPS;
+    }
+    return true;
 }
 
 Object::~Object() {}
@@ -465,8 +1315,51 @@ double Floor::find_ray_intersection(Ray ray) const {
     return t;
 }
 
+void Floor::precompute_primary(const Vector& eye, PrimaryTerms& terms) const {
+    Vector normal = get_normal(reference_point);
+    terms.values[0] = normal.dot(eye) - normal.dot(reference_point);
+}
+
+double Floor::find_primary_intersection(const Ray& ray, double eye_distance,
+                                        const PrimaryTerms& terms) const {
+    double denom = ray.dir.z;
+    if (fabs(denom) < EPS) return -1.0;
+    double t = -terms.values[0] / denom - eye_distance;
+
+    Vector intersection_point = ray.origin + ray.dir * t;
+    if (intersection_point.x < reference_point.x ||
+        intersection_point.x > reference_point.x + floor_width ||
+        intersection_point.y < reference_point.y ||
+        intersection_point.y > reference_point.y + floor_width)
+        return -1.0;
+    return t;
+}
+
 Vector Floor::get_normal(const Vector& point) const { return Vector(0, 0, 1); }
 
+AABB Floor::get_bounds() const {
+    return AABB(reference_point,
+                reference_point + Vector(floor_width, floor_width, 0));
+}
+
+bool Floor::tessellate(std::vector<Vector>& triangles, double& error) const {
+    Vector corners[] = {reference_point,
+                        reference_point + Vector(floor_width, 0, 0),
+                        reference_point + Vector(floor_width, floor_width, 0),
+                        reference_point + Vector(0, floor_width, 0)};
+    for (int i : {0, 1, 2, 0, 2, 3}) triangles.push_back(corners[i]);
+    error = 0;
+    return true;
+}
+
+bool Floor::is_convex() const { return true; }
+
+void Floor::get_geometry(ObjectRecord& record) const {
+    record.type = ObjectRecord::FLOOR;
+    record.params[0] = floor_width;
+    record.params[1] = tile_width;
+}
+
 
 // Sphere
 
@@ -505,12 +1398,88 @@ double Sphere::find_ray_intersection(Ray ray) const {
     return std::min(t_minus, t_plus);
 }
 
+void Sphere::precompute_primary(const Vector& eye, PrimaryTerms& terms) const {
+    Vector center_to_eye = eye - reference_point;
+    terms.values[0] = center_to_eye.x;
+    terms.values[1] = center_to_eye.y;
+    terms.values[2] = center_to_eye.z;
+    terms.values[3] = center_to_eye.dot(center_to_eye) - radius * radius;
+}
+
+double Sphere::find_primary_intersection(const Ray& ray, double eye_distance,
+                                         const PrimaryTerms& terms) const {
+    // solved from the eye with half of b, then moved to the ray's origin
+    const double* v = terms.values;
+    double half_b = ray.dir.x * v[0] + ray.dir.y * v[1] + ray.dir.z * v[2];
+    double discriminant = half_b * half_b - v[3];
+    if (discriminant < 0) return -1.0;
+
+    double t_minus = -half_b - sqrt(discriminant) - eye_distance;
+    double t_plus = -half_b + sqrt(discriminant) - eye_distance;
+
+    if (t_minus < 0 && t_plus < 0) return -1.0;
+    if (t_minus < 0) return t_plus;
+    if (t_plus < 0) return t_minus;
+    return std::min(t_minus, t_plus);
+}
+
 void Sphere::print() const {
     std::cout << "Sphere at (" << reference_point.x << ", " << reference_point.y
               << ", " << reference_point.z << ") with radius " << radius
               << std::endl;
 }
 
+AABB Sphere::get_bounds() const {
+    Vector r(radius, radius, radius);
+    return AABB(reference_point - r, reference_point + r);
+}
+
+bool Sphere::translate(const Vector& offset) {
+    reference_point += offset;
+    return true;
+}
+
+bool Sphere::tessellate(std::vector<Vector>& triangles, double& error) const {
+    // a latitude / longitude grid, fine enough to stay within a thousandth of
+    // the radius (or a hundredth of a unit, for small spheres): no point of a
+    // cell is further from the sphere than the cell's corners are from its
+    // centre, half its diagonal
+    double tolerance = std::max(radius * 1e-3, 0.01);
+    double max_half_diagonal = acos(std::max(-1.0, 1 - tolerance / radius));
+    int stacks = std::min(
+        48, std::max(8, (int)ceil(PI / sqrt(2.0) / max_half_diagonal)));
+    int slices = 2 * stacks;
+    auto point = [&](int i, int j) {
+        double theta = PI * i / stacks, phi = 2 * PI * j / slices;
+        return reference_point + Vector(sin(theta) * cos(phi),
+                                        sin(theta) * sin(phi), cos(theta)) *
+                                     radius;
+    };
+    for (int i = 0; i < stacks; i++) {
+        for (int j = 0; j < slices; j++) {
+            Vector p00 = point(i, j), p01 = point(i, j + 1);
+            Vector p10 = point(i + 1, j), p11 = point(i + 1, j + 1);
+            if (i > 0) triangles.insert(triangles.end(), {p00, p10, p01});
+            if (i < stacks - 1)
+                triangles.insert(triangles.end(), {p01, p10, p11});
+        }
+    }
+    double half_diagonal =
+        sqrt(pow(PI / stacks, 2) + pow(2 * PI / slices, 2)) / 2;
+    error = radius * (1 - cos(half_diagonal));
+    return true;
+}
+
+bool Sphere::is_convex() const { return true; }
+
+void Sphere::get_geometry(ObjectRecord& record) const {
+    record.type = ObjectRecord::SPHERE;
+    record.params[0] = reference_point.x;
+    record.params[1] = reference_point.y;
+    record.params[2] = reference_point.z;
+    record.params[3] = radius;
+}
+
 // Triangle
 
 Triangle::Triangle(const Vector& a, const Vector& b, const Vector& c)
@@ -527,7 +1496,8 @@ void Triangle::draw() const {
     glEnd();
 }
 
-double Triangle::find_ray_intersection(Ray ray) const {
+double intersect_triangle(const Vector& a, const Vector& b, const Vector& c,
+                          const Ray& ray) {
     auto determinant = [](const double(&matrix)[3][3]) -> double {
         return matrix[0][0] *
                    (matrix[1][1] * matrix[2][2] - matrix[1][2] * matrix[2][1]) -
@@ -563,6 +1533,39 @@ double Triangle::find_ray_intersection(Ray ray) const {
     return -1.0;
 }
 
+double Triangle::find_ray_intersection(Ray ray) const {
+    return intersect_triangle(a, b, c, ray);
+}
+
+void Triangle::precompute_primary(const Vector& eye,
+                                  PrimaryTerms& terms) const {
+    // each determinant of intersect_triangle is a triple product with the ray
+    // direction; the cross products not involving it are fixed for the eye
+    Vector edges = (a - b).cross(a - c);
+    Vector beta_terms = (a - eye).cross(a - c);
+    Vector gamma_terms = (a - b).cross(a - eye);
+    const Vector* parts[] = {&edges, &beta_terms, &gamma_terms};
+    for (int i = 0; i < 3; i++) {
+        terms.values[3 * i] = parts[i]->x;
+        terms.values[3 * i + 1] = parts[i]->y;
+        terms.values[3 * i + 2] = parts[i]->z;
+    }
+    terms.values[9] = (a - eye).dot(edges);
+}
+
+double Triangle::find_primary_intersection(const Ray& ray, double eye_distance,
+                                           const PrimaryTerms& terms) const {
+    const double* v = terms.values;
+    const Vector& d = ray.dir;
+    double A_det = d.x * v[0] + d.y * v[1] + d.z * v[2];
+    double beta = (d.x * v[3] + d.y * v[4] + d.z * v[5]) / A_det;
+    double gamma = (d.x * v[6] + d.y * v[7] + d.z * v[8]) / A_det;
+    double t = v[9] / A_det - eye_distance;
+
+    if (beta + gamma < 1 && beta > 0 && gamma > 0 && t > 0) return t;
+    return -1.0;
+}
+
 Vector Triangle::get_normal(const Vector& point) const {
     return (b - a).cross(c - a).normalize();
 }
@@ -572,6 +1575,40 @@ void Triangle::print() const {
               << std::endl;
 }
 
+AABB Triangle::get_bounds() const {
+    AABB box;
+    box.expand(a);
+    box.expand(b);
+    box.expand(c);
+    return box;
+}
+
+bool Triangle::translate(const Vector& offset) {
+    a += offset;
+    b += offset;
+    c += offset;
+    return true;
+}
+
+bool Triangle::tessellate(std::vector<Vector>& triangles,
+                          double& error) const {
+    triangles.insert(triangles.end(), {a, b, c});
+    error = 0;
+    return true;
+}
+
+bool Triangle::is_convex() const { return true; }
+
+void Triangle::get_geometry(ObjectRecord& record) const {
+    record.type = ObjectRecord::TRIANGLE;
+    const Vector* vertices[] = {&a, &b, &c};
+    for (int i = 0; i < 3; i++) {
+        record.params[3 * i] = vertices[i]->x;
+        record.params[3 * i + 1] = vertices[i]->y;
+        record.params[3 * i + 2] = vertices[i]->z;
+    }
+}
+
 
 // GeneralQuadraticSurface
 
@@ -593,11 +1630,51 @@ GeneralQuadraticSurface::GeneralQuadraticSurface(double A, double B, double C,
       J(J),
       length(l),
       width(w),
-      height(h) {}
+      height(h) {
+    classify();
+}
 
-void GeneralQuadraticSurface::draw() const {}
+void GeneralQuadraticSurface::classify() {
+    // exact zeros only; the scene files spell the missing terms out as 0
+    if (D != 0 || E != 0 || F != 0) {
+        shape = GENERAL;
+        intersect_kernel = &GeneralQuadraticSurface::intersect_general;
+        return;
+    }
+
+    // complete the square on every axis that has a square term
+    const double square[] = {A, B, C}, linear_term[] = {G, H, I};
+    double c[3], l[3];
+    constant = J;
+    for (int i = 0; i < 3; i++) {
+        c[i] = 0, l[i] = linear_term[i];
+        if (square[i] != 0) {
+            c[i] = -linear_term[i] / (2 * square[i]), l[i] = 0;
+            constant -= square[i] * c[i] * c[i];
+        }
+    }
+    center = Vector(c[0], c[1], c[2]);
+    linear = Vector(l[0], l[1], l[2]);
+
+    if (A == 0 && B == 0 && C == 0) {
+        shape = PLANE;
+        intersect_kernel = &GeneralQuadraticSurface::intersect_plane;
+    } else if (A == B && B == C) {
+        shape = SPHERE;
+        intersect_kernel = &GeneralQuadraticSurface::intersect_sphere;
+    } else {
+        shape = AXIS_ALIGNED;
+        intersect_kernel = &GeneralQuadraticSurface::intersect_axis_aligned;
+    }
+}
+
+void GeneralQuadraticSurface::draw() const {}
 
 double GeneralQuadraticSurface::find_ray_intersection(Ray ray) const {
+    return (this->*intersect_kernel)(ray);
+}
+
+double GeneralQuadraticSurface::intersect_general(const Ray& ray) const {
     /*
     Ax^2 + By^2 + Cz^2 + Dxy + Eyz + Fzx + Gx + Hy + Iz + J = 0
     Ray Equation:
@@ -624,27 +1701,71 @@ double GeneralQuadraticSurface::find_ray_intersection(Ray ray) const {
         E * ray.origin.y * ray.origin.z + F * ray.origin.z * ray.origin.x +
         G * ray.origin.x + H * ray.origin.y + I * ray.origin.z + J;
 
-    auto valid = [&](double t) {
-        Vector intersection_point = ray.origin + ray.dir * t;
-        if (fabs(length) > EPS &&
-            (intersection_point.x < reference_point.x - EPS ||
-             intersection_point.x > reference_point.x + length + EPS))
-            return false;
-        if (fabs(width) > EPS &&
-            (intersection_point.y < reference_point.y - EPS ||
-             intersection_point.y > reference_point.y + width + EPS))
-            return false;
-        if (fabs(height) > EPS &&
-            (intersection_point.z < reference_point.z - EPS ||
-             intersection_point.z > reference_point.z + height + EPS))
-            return false;
-        return true;
-    };
-
     double discriminant = b * b - 4 * a * c;
     if (discriminant < 0) return -1.0;
     double t_minus = (-b - sqrt(discriminant)) / (2 * a);
     double t_plus = (-b + sqrt(discriminant)) / (2 * a);
+    return choose_root(ray, t_minus, t_plus);
+}
+
+double GeneralQuadraticSurface::intersect_axis_aligned(const Ray& ray) const {
+    Vector u = ray.origin - center;
+    const Vector& d = ray.dir;
+    double a = A * d.x * d.x + B * d.y * d.y + C * d.z * d.z;
+    double half_b =
+        A * u.x * d.x + B * u.y * d.y + C * u.z * d.z + 0.5 * linear.dot(d);
+    double c = A * u.x * u.x + B * u.y * u.y + C * u.z * u.z +
+               linear.dot(u) + constant;
+    return solve(ray, a, half_b, c, 0);
+}
+
+double GeneralQuadraticSurface::intersect_sphere(const Ray& ray) const {
+    // A is common to all three square terms and the center takes the linear
+    // ones
+    Vector u = ray.origin - center;
+    return solve(ray, ray.dir.dot(ray.dir), u.dot(ray.dir),
+                 u.dot(u) + constant / A, 0);
+}
+
+double GeneralQuadraticSurface::intersect_plane(const Ray& ray) const {
+    return solve(ray, 0, 0.5 * linear.dot(ray.dir),
+                 linear.dot(ray.origin) + constant, 0);
+}
+
+double GeneralQuadraticSurface::solve(const Ray& ray, double a, double half_b,
+                                      double c, double shift) const {
+    if (a == 0) {
+        // linear along the ray: a plane, or a ray parallel to the axis of a
+        // cylinder
+        if (half_b == 0) return -1.0;
+        return choose_root(ray, -c / (2 * half_b) - shift, -1.0);
+    }
+    double discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return -1.0;
+    double root = sqrt(discriminant);
+    double t_near = (-half_b - root) / a, t_far = (-half_b + root) / a;
+    if (a < 0) std::swap(t_near, t_far);
+    return choose_root(ray, t_near - shift, t_far - shift);
+}
+
+bool GeneralQuadraticSurface::is_clipped(const Vector& point) const {
+    if (fabs(length) > EPS && (point.x < reference_point.x - EPS ||
+                               point.x > reference_point.x + length + EPS))
+        return true;
+    if (fabs(width) > EPS && (point.y < reference_point.y - EPS ||
+                              point.y > reference_point.y + width + EPS))
+        return true;
+    if (fabs(height) > EPS && (point.z < reference_point.z - EPS ||
+                               point.z > reference_point.z + height + EPS))
+        return true;
+    return false;
+}
+
+double GeneralQuadraticSurface::choose_root(const Ray& ray, double t_minus,
+                                            double t_plus) const {
+    auto valid = [&](double t) {
+        return !is_clipped(ray.origin + ray.dir * t);
+    };
 
     if (t_minus < 0) {
         if (t_plus < 0) return -1.0;
@@ -656,6 +1777,46 @@ double GeneralQuadraticSurface::find_ray_intersection(Ray ray) const {
     }
 }
 
+void GeneralQuadraticSurface::precompute_primary(const Vector& eye,
+                                                 PrimaryTerms& terms) const {
+    // b of find_ray_intersection is the direction dotted with the gradient at
+    // the origin, and c is the surface's value there
+    terms.values[0] = 2 * A * eye.x + D * eye.y + F * eye.z + G;
+    terms.values[1] = 2 * B * eye.y + D * eye.x + E * eye.z + H;
+    terms.values[2] = 2 * C * eye.z + E * eye.y + F * eye.x + I;
+    terms.values[3] = A * eye.x * eye.x + B * eye.y * eye.y +
+                      C * eye.z * eye.z + D * eye.x * eye.y +
+                      E * eye.y * eye.z + F * eye.z * eye.x + G * eye.x +
+                      H * eye.y + I * eye.z + J;
+}
+
+double GeneralQuadraticSurface::find_primary_intersection(
+    const Ray& ray, double eye_distance, const PrimaryTerms& terms) const {
+    const double* v = terms.values;
+    const Vector& d = ray.dir;
+    double b = d.x * v[0] + d.y * v[1] + d.z * v[2];
+    double c = v[3];
+    switch (shape) {
+        case PLANE:
+            return solve(ray, 0, 0.5 * b, c, eye_distance);
+        case SPHERE:
+            return solve(ray, A * d.dot(d), 0.5 * b, c, eye_distance);
+        case AXIS_ALIGNED:
+            return solve(ray, A * d.x * d.x + B * d.y * d.y + C * d.z * d.z,
+                         0.5 * b, c, eye_distance);
+        case GENERAL:
+            break;
+    }
+    double a = A * d.x * d.x + B * d.y * d.y + C * d.z * d.z +
+               D * d.x * d.y + E * d.y * d.z + F * d.z * d.x;
+
+    double discriminant = b * b - 4 * a * c;
+    if (discriminant < 0) return -1.0;
+    double t_minus = (-b - sqrt(discriminant)) / (2 * a) - eye_distance;
+    double t_plus = (-b + sqrt(discriminant)) / (2 * a) - eye_distance;
+    return choose_root(ray, t_minus, t_plus);
+}
+
 Vector GeneralQuadraticSurface::get_normal(const Vector& point) const {
     return Vector(2 * A * point.x + D * point.y + F * point.z + G,
                   2 * B * point.y + D * point.x + E * point.z + H,
@@ -667,7 +1828,76 @@ void GeneralQuadraticSurface::print() const {
     std::cout << "General Quadratic Surface at (" << reference_point.x << ", "
               << reference_point.y << ", " << reference_point.z
               << ") with length " << length << ", width " << width
-              << ", height " << height << std::endl;
+              << ", height " << height << " ("
+              << (shape == PLANE          ? "plane"
+                  : shape == SPHERE       ? "sphere"
+                  : shape == AXIS_ALIGNED ? "axis-aligned"
+                                          : "general")
+              << ")" << std::endl;
+}
+
+AABB GeneralQuadraticSurface::get_bounds() const {
+    // only the clipping cube bounds the surface; a dimension of 0 means no
+    // clipping along that axis
+    AABB box = AABB::infinite();
+    if (fabs(length) > EPS)
+        box.lo.x = reference_point.x, box.hi.x = reference_point.x + length;
+    if (fabs(width) > EPS)
+        box.lo.y = reference_point.y, box.hi.y = reference_point.y + width;
+    if (fabs(height) > EPS)
+        box.lo.z = reference_point.z, box.hi.z = reference_point.z + height;
+    if (shape != AXIS_ALIGNED && shape != SPHERE) return box;
+
+    // With only square terms of one sign and a constant of the other, the
+    // surface is an ellipsoid, or an elliptic cylinder or pair of planes
+    // along the axes without a square term; each square term then bounds
+    // its axis to center +- sqrt(-constant / term).
+    const double square[] = {A, B, C};
+    double sign = 0;
+    for (double term : square) {
+        if (term == 0) continue;
+        if (sign != 0 && (term > 0) != (sign > 0)) return box;
+        sign = term > 0 ? 1 : -1;
+    }
+    if (linear.x != 0 || linear.y != 0 || linear.z != 0 ||
+        sign * constant >= 0)
+        return box;
+    auto tighten = [&](double term, double mid, double& lo, double& hi) {
+        if (term == 0) return;
+        double extent = sqrt(-constant / term);
+        lo = std::max(lo, mid - extent);
+        hi = std::max(lo, std::min(hi, mid + extent));
+    };
+    tighten(A, center.x, box.lo.x, box.hi.x);
+    tighten(B, center.y, box.lo.y, box.hi.y);
+    tighten(C, center.z, box.lo.z, box.hi.z);
+    return box;
+}
+
+bool GeneralQuadraticSurface::translate(const Vector& offset) {
+    // substitute x - p, y - q, z - r for x, y, z; only the linear and
+    // constant terms change
+    double p = offset.x, q = offset.y, r = offset.z;
+    J += A * p * p + B * q * q + C * r * r + D * p * q + E * q * r +
+         F * r * p - G * p - H * q - I * r;
+    G -= 2 * A * p + D * q + F * r;
+    H -= 2 * B * q + D * p + E * r;
+    I -= 2 * C * r + E * q + F * p;
+    reference_point += offset;
+    classify();
+    return true;
+}
+
+void GeneralQuadraticSurface::get_geometry(ObjectRecord& record) const {
+    record.type = ObjectRecord::GENERAL;
+    const double coefficients[] = {A, B, C, D, E, F, G, H, I, J};
+    for (int i = 0; i < 10; i++) record.params[i] = coefficients[i];
+    record.params[10] = reference_point.x;
+    record.params[11] = reference_point.y;
+    record.params[12] = reference_point.z;
+    record.params[13] = length;
+    record.params[14] = width;
+    record.params[15] = height;
 }
 
 // Prism
@@ -769,7 +1999,8 @@ Vector Prism::get_normal(const Vector& point) const {
     throw std::invalid_argument("Point is not on the prism");
 }
 
-void Prism::shade(const Ray& ray, Color& color, int level) const {
+void Prism::shade(const Scene& scene, const Ray& ray, Color& color,
+                  int level) const {
     double t_intersect = find_ray_intersection(ray);
     if (level == 0 || t_intersect < 0) return;
 
@@ -785,7 +2016,8 @@ void Prism::shade(const Ray& ray, Color& color, int level) const {
         surface_normal = -surface_normal;  // mainly for triangle, floor and
                                            // general quadratic surface
 
-    for (LightSource* ls : light_sources) {
+    for (int l : lights) {
+        LightSource* ls = scene.light_sources[l];
         Ray light_ray(
             ls->light_position,
             intersection_point -
@@ -795,13 +2027,11 @@ void Prism::shade(const Ray& ray, Color& color, int level) const {
 
         if (ls->type == LightSource::SPOT) {
             // Continue with spot light unless the ray cast from light_position
-            // to intersection_point exceeds the cutoff angle
+            // to intersection_point exceeds the cutoff angle; both directions
+            // are unit vectors
             SpotLight* sls = (SpotLight*)ls;
-            double dot = light_ray.dir.dot(sls->light_direction);
-            double angle = acos(dot / (light_ray.dir.norm() *
-                                       sls->light_direction.norm())) *
-                           180.0 / PI;
-            if (fabs(angle) >= sls->cutoff_angle) continue;
+            if (light_ray.dir.dot(sls->light_direction) <= sls->cos_cutoff)
+                continue;
         }
 
         // Check if this ray is obscured by any other object
@@ -809,16 +2039,11 @@ void Prism::shade(const Ray& ray, Color& color, int level) const {
         double t_cur = (intersection_point - ls->light_position).norm();
         if (t_cur < EPS)
             continue;  // light source is at the intersection point or in front
+        if (scene.light_range > 0 && t_cur > scene.light_range) continue;
 
-        bool obscured = false;
-        for (Object* obj : objects) {
-            double t = obj->find_ray_intersection(light_ray);
-            if (t > EPS && t + EPS < t_cur) {
-                obscured = true;
-                break;
-            }
-        }
-        if (obscured) continue;
+        if (scene.is_shadowed(l, this, intersection_point, surface_normal,
+                              light_ray, t_cur))
+            continue;
 
         // So, the light ray is not obscured by any other object
 
@@ -849,16 +2074,26 @@ void Prism::shade(const Ray& ray, Color& color, int level) const {
     reflected_ray.origin +=
         reflected_ray.dir * EPS;                   // To avoid self-reflection
 
-    int next_reflection_object_idx = get_next_reflection_object(reflected_ray);
+    int next_reflection_object_idx =
+        get_next_reflection_object(scene, reflected_ray);
     if (next_reflection_object_idx == -1) return;
 
     Color reflected_color(0, 0, 0);
-    objects[next_reflection_object_idx]->shade(reflected_ray, reflected_color,
-                                               level - 1);
+    scene.objects[next_reflection_object_idx]->shade(
+        scene, reflected_ray, reflected_color, level - 1);
     color += reflected_color * phong_coefficients.reflection;
     return;
 }
 
+bool Prism::shade_hit(const Scene& scene, const Ray& ray, int level,
+                      HitShading& shading) const {
+    shading.ambient = Color(0, 0, 0);
+    shade(scene, ray, shading.ambient, level);
+    shading.lights.clear();
+    shading.reflection = 0;
+    return true;
+}
+
 double Prism::find_ray_intersection(Ray ray) const {
     double t_min = 1e9;
     std::vector<Triangle> triangles = {Triangle(a, b, c), Triangle(d, e, f),
@@ -877,6 +2112,455 @@ void Prism::print() const {
               << d << ", " << e << ", " << f << std::endl;
 }
 
+AABB Prism::get_bounds() const {
+    AABB box;
+    for (const Vector* v : {&a, &b, &c, &d, &e, &f}) box.expand(*v);
+    return box;
+}
+
+bool Prism::translate(const Vector& offset) {
+    for (Vector* v : {&a, &b, &c, &d, &e, &f}) *v += offset;
+    return true;
+}
+
+bool Prism::tessellate(std::vector<Vector>& triangles, double& error) const {
+    // the same faces find_ray_intersection tests
+    triangles.insert(triangles.end(), {a, b, c, d, e, f, a, b, d, b, d, e,
+                                       a, c, d, c, d, f, b, c, e, c, e, f});
+    error = 0;
+    return true;
+}
+
+void Prism::get_geometry(ObjectRecord& record) const {
+    record.type = ObjectRecord::PRISM;
+    const Vector* vertices[] = {&a, &b, &c, &d, &e, &f};
+    for (int i = 0; i < 6; i++) {
+        record.params[3 * i] = vertices[i]->x;
+        record.params[3 * i + 1] = vertices[i]->y;
+        record.params[3 * i + 2] = vertices[i]->z;
+    }
+}
+
+// Mesh
+
+namespace {
+
+bool read_obj(const std::string& filename, std::vector<Vector>& vertices,
+              std::vector<uint32_t>& indices) {
+    std::ifstream file(filename);
+    if (!file.is_open()) return false;
+
+    std::string line;
+    std::vector<long long> polygon;
+    while (std::getline(file, line)) {
+        const char* p = line.c_str();
+        while (*p == ' ' || *p == '\t') p++;
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            char* end;
+            double x = strtod(p + 1, &end);
+            double y = strtod(end, &end);
+            double z = strtod(end, &end);
+            vertices.push_back(Vector(x, y, z));
+        } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            // f v1 v2 v3 ..., each entry may be v, v/vt, v//vn or v/vt/vn;
+            // negative indices count back from the last vertex read
+            polygon.clear();
+            p++;
+            while (true) {
+                char* end;
+                long long idx = strtoll(p, &end, 10);
+                if (end == p) break;
+                if (idx < 0) idx += vertices.size();
+                else idx -= 1;
+                if (idx < 0 || idx >= (long long)vertices.size()) return false;
+                polygon.push_back(idx);
+                p = end;
+                while (*p && *p != ' ' && *p != '\t') p++;
+            }
+            for (int i = 1; i + 1 < polygon.size(); i++) {
+                indices.push_back(polygon[0]);
+                indices.push_back(polygon[i]);
+                indices.push_back(polygon[i + 1]);
+            }
+        }
+    }
+    return true;
+}
+
+struct PlyProperty {
+    std::string name, type;
+    bool is_list;
+    std::string count_type;  // lists only
+};
+
+struct PlyElement {
+    std::string name;
+    long long count;
+    std::vector<PlyProperty> properties;
+};
+
+bool read_ply(const std::string& filename, std::vector<Vector>& vertices,
+              std::vector<uint32_t>& indices) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) return false;
+
+    std::string line, format;
+    std::getline(file, line);
+    if (line.compare(0, 3, "ply") != 0) return false;
+
+    std::vector<PlyElement> elements;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+        if (keyword == "format") {
+            words >> format;
+        } else if (keyword == "element") {
+            PlyElement element;
+            words >> element.name >> element.count;
+            elements.push_back(element);
+        } else if (keyword == "property") {
+            if (elements.empty()) return false;
+            PlyProperty property;
+            std::string type;
+            words >> type;
+            property.is_list = type == "list";
+            if (property.is_list) words >> property.count_type >> type;
+            property.type = type;
+            words >> property.name;
+            elements.back().properties.push_back(property);
+        } else if (keyword == "end_header") {
+            break;
+        }
+    }
+
+    bool ascii = format == "ascii";
+    bool big_endian = format == "binary_big_endian";
+    if (!ascii && !big_endian && format != "binary_little_endian")
+        return false;
+    uint16_t probe = 1;
+    bool swap_bytes = big_endian == (*(unsigned char*)&probe == 1);
+
+    auto read_value = [&](const std::string& type, double& value) -> bool {
+        if (ascii) return (bool)(file >> value);
+        unsigned char bytes[8];
+        int size;
+        if (type == "char" || type == "int8" || type == "uchar" ||
+            type == "uint8")
+            size = 1;
+        else if (type == "short" || type == "int16" || type == "ushort" ||
+                 type == "uint16")
+            size = 2;
+        else if (type == "int" || type == "int32" || type == "uint" ||
+                 type == "uint32" || type == "float" || type == "float32")
+            size = 4;
+        else if (type == "double" || type == "float64")
+            size = 8;
+        else
+            return false;
+        if (!file.read((char*)bytes, size)) return false;
+        if (swap_bytes) std::reverse(bytes, bytes + size);
+
+        if (type == "char" || type == "int8") value = *(int8_t*)bytes;
+        else if (type == "uchar" || type == "uint8") value = *(uint8_t*)bytes;
+        else if (type == "short" || type == "int16") value = *(int16_t*)bytes;
+        else if (type == "ushort" || type == "uint16")
+            value = *(uint16_t*)bytes;
+        else if (type == "int" || type == "int32") value = *(int32_t*)bytes;
+        else if (type == "uint" || type == "uint32") value = *(uint32_t*)bytes;
+        else if (type == "float" || type == "float32") value = *(float*)bytes;
+        else value = *(double*)bytes;
+        return true;
+    };
+
+    std::vector<long long> polygon;
+    for (const PlyElement& element : elements) {
+        for (long long item = 0; item < element.count; item++) {
+            double position[3] = {0, 0, 0};
+            for (const PlyProperty& property : element.properties) {
+                if (!property.is_list) {
+                    double value;
+                    if (!read_value(property.type, value)) return false;
+                    if (property.name == "x") position[0] = value;
+                    else if (property.name == "y") position[1] = value;
+                    else if (property.name == "z") position[2] = value;
+                    continue;
+                }
+                double count;
+                if (!read_value(property.count_type, count)) return false;
+                polygon.clear();
+                for (int i = 0; i < (int)count; i++) {
+                    double value;
+                    if (!read_value(property.type, value)) return false;
+                    polygon.push_back((long long)value);
+                }
+                if (element.name != "face" ||
+                    (property.name != "vertex_indices" &&
+                     property.name != "vertex_index"))
+                    continue;
+                for (int i = 1; i + 1 < polygon.size(); i++) {
+                    indices.push_back(polygon[0]);
+                    indices.push_back(polygon[i]);
+                    indices.push_back(polygon[i + 1]);
+                }
+            }
+            if (element.name == "vertex")
+                vertices.push_back(
+                    Vector(position[0], position[1], position[2]));
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+Mesh::Mesh(std::vector<Vector> vertices, std::vector<uint32_t> indices)
+    : vertices(std::move(vertices)), indices(std::move(indices)) {}
+
+Mesh* Mesh::load(const std::string& filename, Arena& arena) {
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   ::tolower);
+
+    std::vector<Vector> vertices;
+    std::vector<uint32_t> indices;
+    bool ok = false;
+    if (extension == "obj") ok = read_obj(filename, vertices, indices);
+    else if (extension == "ply") ok = read_ply(filename, vertices, indices);
+    if (!ok) return nullptr;
+
+    for (const Vector& v : vertices)
+        if (!std::isfinite(v.x) || !std::isfinite(v.y) || !std::isfinite(v.z))
+            return nullptr;
+
+    // a face pointing past the vertices makes the file unreadable; zero area
+    // faces are dropped, they can never be hit and have no normal. "Zero" is
+    // relative to the mesh's size, so small models keep their small faces.
+    AABB bounds;
+    for (const Vector& v : vertices) bounds.expand(v);
+    double diagonal = bounds.is_empty() ? 0 : (bounds.hi - bounds.lo).norm();
+    double min_area = 1e-12 * diagonal * diagonal;
+    int kept = 0;
+    for (int i = 0; i + 2 < indices.size(); i += 3) {
+        uint32_t ia = indices[i], ib = indices[i + 1], ic = indices[i + 2];
+        if (ia >= vertices.size() || ib >= vertices.size() ||
+            ic >= vertices.size())
+            return nullptr;
+        const Vector &a = vertices[ia], &b = vertices[ib], &c = vertices[ic];
+        if ((b - a).cross(c - a).norm() <= min_area) continue;
+        indices[kept++] = ia;
+        indices[kept++] = ib;
+        indices[kept++] = ic;
+    }
+    indices.resize(kept);
+    indices.shrink_to_fit();
+    vertices.shrink_to_fit();
+
+    Mesh* mesh = arena.create<Mesh>(std::move(vertices), std::move(indices));
+    mesh->build_index();
+    return mesh;
+}
+
+int Mesh::face_count() const { return indices.size() / 3; }
+
+void Mesh::build_index() {
+    std::vector<AABB> boxes(face_count());
+    for (int f = 0; f < face_count(); f++) {
+        boxes[f].expand(vertices[indices[3 * f]]);
+        boxes[f].expand(vertices[indices[3 * f + 1]]);
+        boxes[f].expand(vertices[indices[3 * f + 2]]);
+    }
+    face_bvh.build(boxes, 4);
+}
+
+const BVH& Mesh::get_index() const { return face_bvh; }
+
+void Mesh::set_index(const BVH& bvh) { face_bvh = bvh; }
+
+size_t Mesh::memory_used() const {
+    return vertices.capacity() * sizeof(Vector) +
+           indices.capacity() * sizeof(uint32_t) + face_bvh.memory_used();
+}
+
+void Mesh::draw() const {
+    glColor3f(color.r, color.g, color.b);
+    draw_faces();
+}
+
+void Mesh::draw_faces() const {
+    glBegin(GL_TRIANGLES);
+    {
+        for (uint32_t idx : indices) {
+            const Vector& v = vertices[idx];
+            glVertex3f(v.x, v.y, v.z);
+        }
+    }
+    glEnd();
+}
+
+double Mesh::intersect_face(int face, const Ray& ray) const {
+    return intersect_triangle(vertices[indices[3 * face]],
+                              vertices[indices[3 * face + 1]],
+                              vertices[indices[3 * face + 2]], ray);
+}
+
+double Mesh::find_ray_intersection(Ray ray) const {
+    double t_min = 1e9;
+    face_bvh.traverse(ray, t_min, [&](int face) {
+        double t = intersect_face(face, ray);
+        if (t > 0 && t < t_min) t_min = t;
+        return false;
+    });
+    return t_min > 9e8 ? -1.0 : t_min;
+}
+
+Vector Mesh::get_normal(const Vector& point) const {
+    // the face the point lies on: the one whose plane is closest among the
+    // faces whose (padded) bounds contain the point
+    int best_face = -1;
+    double best_distance = 1e9;
+    face_bvh.query(point, [&](int face) {
+        const Vector& a = vertices[indices[3 * face]];
+        const Vector& b = vertices[indices[3 * face + 1]];
+        const Vector& c = vertices[indices[3 * face + 2]];
+        Vector u = b - a, v = c - a, w = point - a;
+        Vector normal = u.cross(v);
+        double dot = normal.dot(normal);
+        double gamma = (u.cross(w)).dot(normal) / dot;
+        double beta = (w.cross(v)).dot(normal) / dot;
+        double alpha = 1 - beta - gamma;
+        if (alpha < -EPS || beta < -EPS || gamma < -EPS) return false;
+        double plane_distance = fabs(w.dot(normal)) / sqrt(dot);
+        if (plane_distance < best_distance) {
+            best_distance = plane_distance;
+            best_face = face;
+        }
+        return false;
+    });
+    if (best_face == -1) return Vector(0, 0, 1);
+
+    const Vector& a = vertices[indices[3 * best_face]];
+    const Vector& b = vertices[indices[3 * best_face + 1]];
+    const Vector& c = vertices[indices[3 * best_face + 2]];
+    return (b - a).cross(c - a).normalize();
+}
+
+AABB Mesh::get_bounds() const {
+    AABB box;
+    for (const Vector& v : vertices) box.expand(v);
+    return box;
+}
+
+bool Mesh::tessellate(std::vector<Vector>& triangles, double& error) const {
+    for (uint32_t index : indices) triangles.push_back(vertices[index]);
+    error = 0;
+    return true;
+}
+
+void Mesh::get_geometry(ObjectRecord& record) const {
+    // the arrays themselves are written by save_scene_cache()
+    record.type = ObjectRecord::MESH;
+}
+
+void Mesh::print() const {
+    std::cout << "Mesh with " << vertices.size() << " vertices and "
+              << face_count() << " faces" << std::endl;
+}
+
+// Instance
+
+Instance::Instance(const Mesh* prototype, const Matrix& transform)
+    : object_to_world(transform),
+      world_to_object(transform.inverse()),
+      prototype(prototype) {}
+
+const Matrix& Instance::get_transform() const { return object_to_world; }
+
+void Instance::set_transform(const Matrix& transform) {
+    object_to_world = transform;
+    world_to_object = transform.inverse();
+}
+
+void Instance::draw() const {
+    // OpenGL wants the matrix column major
+    double gl_matrix[16];
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            gl_matrix[4 * j + i] = object_to_world.data[i][j];
+
+    glColor3f(color.r, color.g, color.b);
+    glPushMatrix();
+    glMultMatrixd(gl_matrix);
+    prototype->draw_faces();
+    glPopMatrix();
+}
+
+double Instance::find_ray_intersection(Ray ray) const {
+    // t is measured along the unit direction on both sides, so the object
+    // space distance has to be scaled back by the length of the transformed
+    // direction
+    Vector local_dir = world_to_object.transform_direction(ray.dir);
+    double scale = local_dir.norm();
+    if (scale <= EPS) return -1.0;
+    Ray local_ray(world_to_object.transform_point(ray.origin), local_dir);
+    double t = prototype->find_ray_intersection(local_ray);
+    if (t < 0) return -1.0;
+    return t / scale;
+}
+
+Vector Instance::get_normal(const Vector& point) const {
+    // normals transform with the inverse transpose
+    Vector local_normal =
+        prototype->get_normal(world_to_object.transform_point(point));
+    return world_to_object.transpose()
+        .transform_direction(local_normal)
+        .normalize();
+}
+
+AABB Instance::get_bounds() const {
+    AABB local = prototype->get_bounds(), box;
+    for (int corner = 0; corner < 8; corner++) {
+        Vector p((corner & 1) ? local.hi.x : local.lo.x,
+                 (corner & 2) ? local.hi.y : local.lo.y,
+                 (corner & 4) ? local.hi.z : local.lo.z);
+        box.expand(object_to_world.transform_point(p));
+    }
+    return box;
+}
+
+bool Instance::translate(const Vector& offset) {
+    Matrix translation;
+    translation.data[0][3] = offset.x;
+    translation.data[1][3] = offset.y;
+    translation.data[2][3] = offset.z;
+    set_transform(translation * object_to_world);
+    return true;
+}
+
+bool Instance::tessellate(std::vector<Vector>& triangles,
+                          double& error) const {
+    // the prototype is a mesh, which is exact whatever the transform
+    std::vector<Vector> local;
+    if (!prototype->tessellate(local, error)) return false;
+    for (const Vector& v : local)
+        triangles.push_back(object_to_world.transform_point(v));
+    return true;
+}
+
+void Instance::get_geometry(ObjectRecord& record) const {
+    // the prototype index is filled in by save_scene_cache()
+    record.type = ObjectRecord::INSTANCE;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            record.params[4 * i + j] = object_to_world.data[i][j];
+}
+
+void Instance::print() const {
+    std::cout << "Instance of a mesh with " << prototype->face_count()
+              << " faces" << std::endl;
+}
+
 // Light Source
 
 LightSource::LightSource(const Vector& pos, double r, double g, double b,
@@ -906,6 +2590,7 @@ SpotLight::SpotLight(const Vector& pos, double r, double g, double b,
                      const Vector& dir, double angle)
     : LightSource(pos, r, g, b, SPOT), cutoff_angle(angle) {
     light_direction = dir.normalize();
+    cos_cutoff = cos(std::min(std::max(angle, 0.0), 180.0) * PI / 180);
 }
 
 void SpotLight::draw() const {
@@ -915,3 +2600,1284 @@ void SpotLight::draw() const {
     glutSolidSphere(2, 50, 50);
     glPopMatrix();
 }
+
+
+
+// Shadow Maps
+
+namespace {
+
+// as in the rasterization assignment: the eye at the origin, looking down
+// -z with up along +y
+Matrix generate_view_matrix(const Vector& eye, const Vector& right,
+                            const Vector& up, const Vector& look) {
+    Matrix translation;
+    translation.data[0][3] = -eye.x;
+    translation.data[1][3] = -eye.y;
+    translation.data[2][3] = -eye.z;
+    Matrix rotation;
+    const Vector* rows[] = {&right, &up, &look};
+    for (int i = 0; i < 3; i++) {
+        double sign = i == 2 ? -1 : 1;
+        rotation.data[i][0] = sign * rows[i]->x;
+        rotation.data[i][1] = sign * rows[i]->y;
+        rotation.data[i][2] = sign * rows[i]->z;
+    }
+    return rotation * translation;
+}
+
+Matrix generate_view_matrix(const Vector& eye, const Vector& look,
+                            const Vector& up) {
+    Vector look_vector = (look - eye).normalize();
+    Vector right_vector = look_vector.cross(up).normalize();
+    Vector up_vector = right_vector.cross(look_vector).normalize();
+    return generate_view_matrix(eye, right_vector, up_vector, look_vector);
+}
+
+Matrix generate_projection_matrix(double fov_y, double aspect_ratio,
+                                  double near, double far) {
+    double fov_x = fov_y * aspect_ratio;
+    double t = near * tan(fov_y * PI / 360.0);
+    double r = near * tan(fov_x * PI / 360.0);
+    Matrix projection;
+    projection.data[0][0] = near / r;
+    projection.data[1][1] = near / t;
+    projection.data[2][2] = -(far + near) / (far - near);
+    projection.data[2][3] = -(2 * far * near) / (far - near);
+    projection.data[3][2] = -1;
+    projection.data[3][3] = 0;
+    return projection;
+}
+
+// Scan converts the triangle (in normalized device coordinates) into a
+// z-buffer of width x height texels, keeping the nearest z of each and
+// calling write with the texel whenever it does. Texel centres are sampled,
+// top row first, like the assignment's scanlines.
+template <typename Write>
+void scan_convert(Vector a, Vector b, Vector c, int width, int height,
+                  std::vector<double>& z_buffer, Write write) {
+    // a is the top vertex, c the bottom one
+    if (a.y < b.y) std::swap(a, b);
+    if (a.y < c.y) std::swap(a, c);
+    if (b.y < c.y) std::swap(b, c);
+    if (a.y - c.y < EPS * EPS) return;
+
+    double dx = 2.0 / width, dy = 2.0 / height;
+    double top_y = 1 - dy / 2, left_x = -1 + dx / 2;
+    int top_row = std::max(0, (int)ceil((top_y - a.y) / dy));
+    int bottom_row = std::min(height - 1, (int)floor((top_y - c.y) / dy));
+
+    for (int i = top_row; i <= bottom_row; i++) {
+        double y_s = top_y - i * dy;
+        // the long edge ac, and ab or bc, whichever spans the scanline
+        double f = (a.y - y_s) / (a.y - c.y);
+        double x_a = a.x + (c.x - a.x) * f, z_a = a.z + (c.z - a.z) * f;
+        const Vector& from = (y_s >= b.y && a.y > b.y) ? a : b;
+        const Vector& to = (y_s >= b.y && a.y > b.y) ? b : c;
+        double g = from.y - to.y < EPS * EPS ? 0 : (from.y - y_s) /
+                                                       (from.y - to.y);
+        double x_b = from.x + (to.x - from.x) * g;
+        double z_b = from.z + (to.z - from.z) * g;
+        if (x_a > x_b) {
+            std::swap(x_a, x_b);
+            std::swap(z_a, z_b);
+        }
+
+        int left_col = std::max(0, (int)ceil((x_a - left_x) / dx));
+        int right_col = std::min(width - 1, (int)floor((x_b - left_x) / dx));
+        for (int j = left_col; j <= right_col; j++) {
+            double x_p = left_x + j * dx;
+            double z_p =
+                x_b - x_a < EPS * EPS
+                    ? z_a
+                    : z_b - (z_b - z_a) * (x_b - x_p) / (x_b - x_a);
+            double& z = z_buffer[i * width + j];
+            if (z_p >= -1 && z_p < z) {
+                z = z_p;
+                write(i * width + j);
+            }
+        }
+    }
+}
+
+// Calls cover with every texel of a width x height grid that the triangle
+// (in normalized device coordinates) touches once grown by margin all
+// round, and with the least z its plane takes over that texel, grown the
+// same way. Texels are kept unless one of the triangle's edges separates
+// them from it, so a few just past its corners come too, but none it
+// touches are missed, however small it is.
+template <typename Cover>
+void cover_convert(const Vector& a, const Vector& b, const Vector& c,
+                   int width, int height, double margin, Cover cover) {
+    double dx = 2.0 / width, dy = 2.0 / height;
+    double min_x = std::min({a.x, b.x, c.x}) - margin;
+    double max_x = std::max({a.x, b.x, c.x}) + margin;
+    double min_y = std::min({a.y, b.y, c.y}) - margin;
+    double max_y = std::max({a.y, b.y, c.y}) + margin;
+    int left_col = std::max(0, (int)floor((min_x + 1) / dx));
+    int right_col = std::min(width - 1, (int)floor((max_x + 1) / dx));
+    int top_row = std::max(0, (int)floor((1 - max_y) / dy));
+    int bottom_row = std::min(height - 1, (int)floor((1 - min_y) / dy));
+    if (left_col > right_col || top_row > bottom_row) return;
+
+    // z = a.z + gradient_x (x - a.x) + gradient_y (y - a.y) on the plane;
+    // a triangle seen edge on has no usable plane, nor edges to test, and
+    // is covered as its bounding box at its nearest corner's z
+    double min_z = std::max(-1.0, std::min({a.z, b.z, c.z}));
+    double area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    bool flat = fabs(area) < EPS * EPS;
+    double gradient_x = 0, gradient_y = 0;
+    // inward normals of the edges
+    double normal_x[3] = {0, 0, 0}, normal_y[3] = {0, 0, 0};
+    const Vector* corners[] = {&a, &b, &c};
+    if (!flat) {
+        gradient_x = ((b.z - a.z) * (c.y - a.y) - (c.z - a.z) * (b.y - a.y)) /
+                     area;
+        gradient_y = ((c.z - a.z) * (b.x - a.x) - (b.z - a.z) * (c.x - a.x)) /
+                     area;
+        double sign = area > 0 ? 1 : -1;
+        for (int m = 0; m < 3; m++) {
+            const Vector &p = *corners[m], &q = *corners[(m + 1) % 3];
+            normal_x[m] = -(q.y - p.y) * sign;
+            normal_y[m] = (q.x - p.x) * sign;
+        }
+    }
+
+    for (int i = top_row; i <= bottom_row; i++) {
+        double y0 = 1 - (i + 1) * dy - margin, y1 = 1 - i * dy + margin;
+        // a texel is separated by an edge if even its corner furthest along
+        // the edge's inward normal is outside it; on a row, that leaves the
+        // columns on one side of a bound, a hair wider for the rounding
+        int first = left_col, last = right_col;
+        for (int m = 0; m < 3 && !flat; m++) {
+            const Vector& p = *corners[m];
+            double inside = normal_y[m] * ((normal_y[m] > 0 ? y1 : y0) - p.y);
+            if (normal_x[m] == 0) {
+                if (inside < 0) last = -1;
+                continue;
+            }
+            // the column whose left edge the edge function is zero at
+            double x = (p.x - inside / normal_x[m] + 1) / dx;
+            if (normal_x[m] > 0)
+                first = std::max(first, (int)ceil(x - margin / dx - 1 - 1e-6));
+            else
+                last = std::min(last, (int)floor(x + margin / dx + 1e-6));
+        }
+        // the plane's least z over a texel is at one of its corners
+        double y = gradient_y > 0 ? y0 : y1;
+        double row_z = flat ? min_z
+                            : a.z + gradient_y * (y - a.y) - gradient_x * a.x +
+                                  gradient_x * (gradient_x > 0
+                                                    ? -1 - margin
+                                                    : -1 + dx + margin);
+        for (int j = first; j <= last; j++)
+            cover(i * width + j, std::max(row_z + gradient_x * j * dx, min_z));
+    }
+}
+
+// The triangle's corners taken through the view matrix and clipped against
+// the near plane, which leaves at most four vertices in polygon; returns
+// how many, 0 if it is wholly outside one side of the frustum, with the
+// four sides moved out by slack.
+int clip_triangle(const Vector* corners, const Matrix& view, double tan_half_x,
+                  double tan_half_y, double near, double slack,
+                  Vector (&polygon)[4]) {
+    Vector eye[3];
+    for (int m = 0; m < 3; m++) eye[m] = view.transform_point(corners[m]);
+    // the sides' normals are not unit length
+    double slack_x = slack * sqrt(1 + tan_half_x * tan_half_x);
+    double slack_y = slack * sqrt(1 + tan_half_y * tan_half_y);
+    bool outside = false;
+    for (int side = 0; side < 5 && !outside; side++) {
+        outside = true;
+        for (int m = 0; m < 3 && outside; m++) {
+            double depth = -eye[m].z;
+            outside = side == 0   ? eye[m].x - depth * tan_half_x > slack_x
+                      : side == 1 ? -eye[m].x - depth * tan_half_x > slack_x
+                      : side == 2 ? eye[m].y - depth * tan_half_y > slack_y
+                      : side == 3 ? -eye[m].y - depth * tan_half_y > slack_y
+                                  : depth < near;
+        }
+    }
+    if (outside) return 0;
+
+    int count = 0;
+    for (int m = 0; m < 3; m++) {
+        const Vector& p = eye[m];
+        const Vector& q = eye[(m + 1) % 3];
+        bool p_in = p.z <= -near, q_in = q.z <= -near;
+        if (p_in) polygon[count++] = p;
+        if (p_in != q_in)
+            polygon[count++] = p + (q - p) * ((-near - p.z) / (q.z - p.z));
+    }
+    return count;
+}
+
+// the assignment widens the angle by the aspect ratio; widening its tangent
+// instead keeps the texel centres where View puts its pixels
+Matrix frustum_projection(double tan_half_x, double tan_half_y, double near,
+                          double far) {
+    Matrix projection = generate_projection_matrix(
+        2 * atan(tan_half_y) * 180 / PI, 1, near, far);
+    projection.data[0][0] *= tan_half_y / tan_half_x;
+    return projection;
+}
+
+// Rasterizes the triangles (three points each) seen through the view matrix
+// into the z-buffer, whose width x height texels span tan_half_x and
+// tan_half_y either side of the axis at unit depth. write is called with
+// the triangle and the texel whenever a triangle is the nearest so far.
+template <typename Write>
+void rasterize_triangles(const std::vector<Vector>& triangles,
+                         const Matrix& view, double tan_half_x,
+                         double tan_half_y, double near, double far,
+                         int width, int height, std::vector<double>& z_buffer,
+                         Write write) {
+    Matrix projection = frustum_projection(tan_half_x, tan_half_y, near, far);
+    Vector polygon[4];
+    for (size_t k = 0; k + 2 < triangles.size(); k += 3) {
+        int count = clip_triangle(&triangles[k], view, tan_half_x, tan_half_y,
+                                  near, 0, polygon);
+        for (int m = 0; m < count; m++)
+            polygon[m] = projection.transform_point(polygon[m]);
+        int triangle = k / 3;
+        for (int m = 1; m + 1 < count; m++)
+            scan_convert(polygon[0], polygon[m], polygon[m + 1], width, height,
+                         z_buffer, [&](int texel) { write(triangle, texel); });
+    }
+}
+
+// Like rasterize_triangles, but calls cover with the triangle, every texel
+// it touches anywhere (see cover_convert) and its least normalized device z
+// there. The triangles stand for surfaces up to errors[owners[triangle]]
+// away, so each is grown by what that can amount to at its nearest.
+template <typename Cover>
+void cover_triangles(const std::vector<Vector>& triangles,
+                     const std::vector<int>& owners,
+                     const std::vector<double>& errors, const Matrix& view,
+                     double tan_half_x, double tan_half_y, double near,
+                     double far, int width, int height, Cover cover) {
+    Matrix projection = frustum_projection(tan_half_x, tan_half_y, near, far);
+    double tan_least = std::min(tan_half_x, tan_half_y);
+    double tan_most = std::max(tan_half_x, tan_half_y);
+    Vector polygon[4];
+    for (size_t k = 0; k + 2 < triangles.size(); k += 3) {
+        double error = errors[owners[k / 3]];
+        // grown, it may reach into the frustum from just outside a side
+        int count = clip_triangle(&triangles[k], view, tan_half_x, tan_half_y,
+                                  near, error, polygon);
+        if (count == 0) continue;
+        // moving a point by error at depth d moves x / d by at most
+        // error (1 + x / d) / (d - error), and x / d is within the frustum
+        // where it matters; a thousandth of a texel covers the rounding
+        double nearest = INFINITY;
+        for (int m = 0; m < count; m++)
+            nearest = std::min(nearest, -polygon[m].z);
+        double margin = error * (1 + tan_most) /
+                            (std::max(near, nearest - error) * tan_least) +
+                        2e-3 / std::min(width, height);
+        for (int m = 0; m < count; m++)
+            polygon[m] = projection.transform_point(polygon[m]);
+        int triangle = k / 3;
+        for (int m = 1; m + 1 < count; m++)
+            cover_convert(polygon[0], polygon[m], polygon[m + 1], width,
+                          height, margin, [&](int texel, double z) {
+                              cover(triangle, texel, z);
+                          });
+    }
+}
+
+// Covers the triangles as cover_triangles does, keeping per texel the object
+// of the nearest one touching it in nearest (-1 for none), its z in
+// nearest_z and the least z of any other object's in other_z, 1 where there
+// is none.
+void cover_nearest(const std::vector<Vector>& triangles,
+                   const std::vector<int>& owners,
+                   const std::vector<double>& errors, const Matrix& view,
+                   double tan_half_x, double tan_half_y, double near,
+                   double far, int width, int height,
+                   std::vector<int32_t>& nearest,
+                   std::vector<double>& nearest_z,
+                   std::vector<double>& other_z) {
+    nearest.assign((size_t)width * height, -1);
+    nearest_z.assign(nearest.size(), 1.0);
+    other_z.assign(nearest.size(), 1.0);
+    cover_triangles(
+        triangles, owners, errors, view, tan_half_x, tan_half_y, near, far,
+        width, height, [&](int triangle, int texel, double z) {
+            int owner = owners[triangle];
+            if (owner == nearest[texel]) {
+                nearest_z[texel] = std::min(nearest_z[texel], z);
+            } else if (z < nearest_z[texel]) {
+                // the nearest object so far was the nearest of all the
+                // others too
+                other_z[texel] = nearest_z[texel];
+                nearest[texel] = owner;
+                nearest_z[texel] = z;
+            } else {
+                other_z[texel] = std::min(other_z[texel], z);
+            }
+        });
+}
+
+// back from normalized device z to the distance along the axis
+double axis_distance(double z, double near, double far) {
+    return z >= 1 ? INFINITY
+                  : 2 * far * near / ((far + near) - z * (far - near));
+}
+
+}  // namespace
+
+ShadowMap::ShadowMap(const LightSource& light,
+                     const std::vector<Vector>& triangles,
+                     const std::vector<int>& owners,
+                     const std::vector<double>& errors, int resolution)
+    : owners(owners),
+      position(light.light_position),
+      resolution(resolution),
+      tan_half_fov(1),
+      near(1e-2) {
+    double farthest = 0;
+    for (const Vector& v : triangles)
+        farthest = std::max(farthest, (v - position).norm());
+    far = farthest * 1.01 + 1;
+    // depths are stored as floats
+    tolerance = far * 1e-6;
+    if (!errors.empty())
+        tolerance += *std::max_element(errors.begin(), errors.end());
+
+    auto add_face = [&](const Vector& axis) {
+        Vector up = fabs(axis.z) < 0.9 ? Vector(0, 0, 1) : Vector(1, 0, 0);
+        Face face;
+        face.view = generate_view_matrix(position, position + axis, up);
+        faces.push_back(face);
+    };
+    const SpotLight* spot = light.type == LightSource::SPOT
+                                ? static_cast<const SpotLight*>(&light)
+                                : nullptr;
+    if (spot && spot->cutoff_angle < 60) {
+        // a degree of margin around the cone
+        tan_half_fov = tan((spot->cutoff_angle + 1) * PI / 180);
+        add_face(spot->light_direction);
+    } else {
+        for (int axis = 0; axis < 3; axis++) {
+            for (double sign : {1.0, -1.0}) {
+                Vector direction;
+                (axis == 0 ? direction.x : axis == 1 ? direction.y
+                                                     : direction.z) = sign;
+                add_face(direction);
+            }
+        }
+    }
+    for (Face& face : faces) rasterize(face, triangles, errors);
+}
+
+void ShadowMap::rasterize(Face& face, const std::vector<Vector>& triangles,
+                          const std::vector<double>& errors) {
+    std::vector<double> z_buffer((size_t)resolution * resolution, 1.0);
+    face.triangles.assign(z_buffer.size(), -1);
+    rasterize_triangles(triangles, face.view, tan_half_fov, tan_half_fov, near,
+                        far, resolution, resolution, z_buffer,
+                        [&](int triangle, int texel) {
+                            face.triangles[texel] = triangle;
+                        });
+
+    face.depth.resize(z_buffer.size());
+    for (size_t i = 0; i < z_buffer.size(); i++)
+        face.depth[i] = axis_distance(z_buffer[i], near, far);
+
+    std::vector<double> other_z;
+    cover_nearest(triangles, owners, errors, face.view, tan_half_fov,
+                  tan_half_fov, near, far, resolution, resolution,
+                  face.cover_owners, z_buffer, other_z);
+    face.cover_depth.resize(z_buffer.size());
+    face.other_depth.resize(z_buffer.size());
+    for (size_t i = 0; i < z_buffer.size(); i++) {
+        face.cover_depth[i] = axis_distance(z_buffer[i], near, far);
+        face.other_depth[i] = axis_distance(other_z[i], near, far);
+    }
+}
+
+ShadowMap::Result ShadowMap::classify(
+    const Vector& point, const Vector& normal, const Object* receiver,
+    const std::vector<Object*>& objects) const {
+    // the cube's faces are +x, -x, +y, -y, +z and -z; the point is on the
+    // one of the axis it is furthest along
+    int index = 0;
+    if (faces.size() == 6) {
+        Vector d = point - position;
+        double extent[] = {fabs(d.x), fabs(d.y), fabs(d.z)};
+        int axis = std::max_element(extent, extent + 3) - extent;
+        index = 2 * axis + ((axis == 0 ? d.x : axis == 1 ? d.y : d.z) < 0);
+    }
+    const Face& face = faces[index];
+    Vector p = face.view.transform_point(point);
+    double depth = -p.z;
+    if (depth < near) return UNKNOWN;
+    double x = p.x / (depth * tan_half_fov);
+    double y = p.y / (depth * tan_half_fov);
+    int col = floor((x + 1) / 2 * resolution);
+    int row = floor((1 - y) / 2 * resolution);
+    // the texels around it have to be on this face
+    if (col < 1 || row < 1 || col > resolution - 2 || row > resolution - 2)
+        return UNKNOWN;
+
+    // no other object may come nearer than the point anywhere in its texel
+    int texel = row * resolution + col;
+    int nearest = face.cover_owners[texel];
+    float others = nearest != -1 && objects[nearest] == receiver
+                       ? face.other_depth[texel]
+                       : face.cover_depth[texel];
+    bool lit = others > depth + tolerance + depth * 1e-6;
+    // and a convex receiver cannot get in the way itself if its outside
+    // faces the light
+    if (lit && receiver->is_convex() &&
+        receiver->get_normal(point).dot(position - point) > 0)
+        return LIT;
+
+    // q . n = plane for the points q of the tangent plane
+    Vector n = face.view.transform_direction(normal);
+    double plane = p.dot(n);
+    // how far the tessellation may be off along the light's rays grows as
+    // the surface turns away from the light
+    double cos_incidence = fabs(plane) / (p.norm() * n.norm());
+    if (cos_incidence < 0.05) return UNKNOWN;
+    double slack = (tolerance + depth * 1e-6) / cos_incidence;
+
+    bool shadowed = true;
+    // of the texels with a surface clearly in front
+    int occluder = -1;
+    bool one_triangle = true, one_object = true;
+    for (int i = row - 1; i <= row + 1; i++) {
+        for (int j = col - 1; j <= col + 1; j++) {
+            // the texel centre's direction, at unit depth
+            Vector dir((-1 + (2 * j + 1.0) / resolution) * tan_half_fov,
+                       (1 - (2 * i + 1.0) / resolution) * tan_half_fov, -1);
+            double expected = plane / dir.dot(n);
+            if (expected <= 0) return UNKNOWN;
+            int texel = i * resolution + j;
+            int triangle = face.triangles[texel];
+            if (face.depth[texel] < expected - slack) {
+                lit = false;
+                if (occluder == -1) occluder = triangle;
+                one_triangle = one_triangle && triangle == occluder;
+                one_object =
+                    one_object && owners[triangle] == owners[occluder];
+            } else {
+                shadowed = false;
+            }
+        }
+    }
+    if (shadowed && !one_triangle &&
+        !(one_object && objects[owners[occluder]]->is_convex()))
+        shadowed = false;
+    return lit ? LIT : shadowed ? SHADOWED : UNKNOWN;
+}
+
+size_t ShadowMap::memory_used() const {
+    size_t bytes = 0;
+    for (const Face& face : faces)
+        bytes += sizeof(Face) + face.depth.capacity() * sizeof(float) +
+                 face.triangles.capacity() * sizeof(int32_t) +
+                 face.cover_owners.capacity() * sizeof(int32_t) +
+                 (face.cover_depth.capacity() + face.other_depth.capacity()) *
+                     sizeof(float);
+    return bytes + owners.capacity() * sizeof(int);
+}
+
+// Visibility Buffer
+
+VisibilityBuffer::VisibilityBuffer(const Scene& scene, const View& view,
+                                   double far)
+    : width(view.width),
+      height(view.height),
+      ids((size_t)view.width * view.height, -1) {
+    const Camera& camera = view.camera;
+    Matrix view_matrix = generate_view_matrix(camera.pos, camera.right,
+                                              camera.up, camera.look);
+    // the image plane is at unit distance, and nothing in front of it is
+    // traced either
+    double tan_half_y = view.dv * height / 2, tan_half_x = view.du * width / 2;
+    std::vector<double> z_buffer(ids.size(), 1.0);
+    rasterize_triangles(scene.tessellation, view_matrix, tan_half_x,
+                        tan_half_y, 1, far, width, height, z_buffer,
+                        [&](int triangle, int pixel) {
+                            ids[pixel] = scene.tessellation_owners[triangle];
+                        });
+
+    // the surfaces may be up to their error nearer than their triangles
+    double error = 0;
+    for (double e : scene.tessellation_errors) error = std::max(error, e);
+    std::vector<int32_t> nearest;
+    std::vector<double> other_z;
+    cover_nearest(scene.tessellation, scene.tessellation_owners,
+                  scene.tessellation_errors, view_matrix, tan_half_x,
+                  tan_half_y, 1, far, width, height, nearest, z_buffer,
+                  other_z);
+    others.resize(ids.size());
+    for (size_t k = 0; k < ids.size(); k++) {
+        double z = nearest[k] == ids[k] ? other_z[k] : z_buffer[k];
+        // floats round by far less than a millionth
+        others[k] = (axis_distance(z, 1, far) - error) * (1 - 1e-6);
+    }
+}
+
+int VisibilityBuffer::id(int i, int j) const { return ids[j * width + i]; }
+
+double VisibilityBuffer::others_depth(int i, int j) const {
+    return others[j * width + i];
+}
+
+
+
+// Arena
+
+Arena::Arena(size_t block_size)
+    : cursor(nullptr), left(0), block_size(block_size), used(0) {}
+
+Arena::~Arena() { clear(); }
+
+void* Arena::allocate(size_t size, size_t alignment) {
+    size_t padding = (alignment - (uintptr_t)cursor % alignment) % alignment;
+    if (cursor == nullptr || padding + size > left) {
+        // oversized requests get a block of their own
+        size_t bytes = std::max(block_size, size + alignment);
+        blocks.emplace_back(new char[bytes]);
+        cursor = blocks.back().get();
+        left = bytes;
+        padding = (alignment - (uintptr_t)cursor % alignment) % alignment;
+    }
+    void* memory = cursor + padding;
+    cursor += padding + size;
+    left -= padding + size;
+    used += size;
+    return memory;
+}
+
+void Arena::clear() {
+    for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+        it->second(it->first);
+    destructors.clear();
+    blocks.clear();
+    cursor = nullptr;
+    left = used = 0;
+}
+
+size_t Arena::bytes_used() const { return used; }
+
+
+
+// Scene
+
+void Scene::clear() {
+    objects.clear();
+    light_sources.clear();
+    bvh.clear();
+    spheres.clear();
+    dependencies.clear();
+    tessellation.clear();
+    tessellation_owners.clear();
+    tessellation_errors.clear();
+    untessellated.clear();
+    shadow_maps.clear();
+    shadow_map_resolution = 0;
+    changed_objects.clear();
+    object_bounds.clear();
+    arena.clear();
+}
+
+void Scene::select_shading() {
+    for (Object* o : objects) o->select_shading(*this);
+}
+
+size_t Scene::memory_used() const {
+    size_t bytes = arena.bytes_used() + bvh.memory_used() +
+                   spheres.memory_used() +
+                   objects.capacity() * sizeof(Object*) +
+                   light_sources.capacity() * sizeof(LightSource*) +
+                   tessellation.capacity() * sizeof(Vector) +
+                   tessellation_errors.capacity() * sizeof(double) +
+                   (tessellation_owners.capacity() + untessellated.capacity() +
+                    changed_objects.capacity()) *
+                       sizeof(int) +
+                   object_bounds.capacity() * sizeof(AABB);
+    for (const std::unique_ptr<ShadowMap>& map : shadow_maps)
+        bytes += map->memory_used();
+    // meshes keep their arrays outside the arena; a prototype counts once
+    // however many instances share it
+    std::set<const Mesh*> meshes;
+    for (Object* o : objects) {
+        ObjectRecord record;
+        o->get_geometry(record);
+        if (record.type == ObjectRecord::MESH)
+            meshes.insert((const Mesh*)o);
+        else if (record.type == ObjectRecord::INSTANCE)
+            meshes.insert(((const Instance*)o)->prototype);
+    }
+    for (const Mesh* mesh : meshes) bytes += mesh->memory_used();
+    return bytes;
+}
+
+namespace {
+
+// what the scene's BVH is built over: the bounds of its objects, empty for
+// those in its sphere set
+std::vector<AABB> indexed_bounds(const Scene& scene) {
+    std::vector<AABB> boxes = scene.object_bounds;
+    for (int k = 0; k < boxes.size(); k++)
+        if (scene.spheres.contains(k)) boxes[k] = AABB();
+    return boxes;
+}
+
+}  // namespace
+
+void Scene::build_index() {
+    object_bounds.clear();
+    for (Object* o : objects) object_bounds.push_back(o->get_bounds());
+    spheres.build(objects);
+    bvh.build(indexed_bounds(*this));
+    changed_objects.clear();
+}
+
+bool Scene::move_object(int index, const Vector& offset) {
+    if (!objects[index]->translate(offset)) return false;
+    object_changed(index);
+    return true;
+}
+
+void Scene::object_changed(int index) { changed_objects.push_back(index); }
+
+bool Scene::update_index(double max_degradation) {
+    if (changed_objects.empty()) return true;
+    // a scene from the cache comes with its BVH but not the bounds
+    if (object_bounds.size() != objects.size()) {
+        object_bounds.clear();
+        for (Object* o : objects) object_bounds.push_back(o->get_bounds());
+    }
+    for (int k : changed_objects) object_bounds[k] = objects[k]->get_bounds();
+    std::vector<AABB> boxes = indexed_bounds(*this);
+    bool refitted = bvh.refit(boxes, changed_objects, max_degradation);
+    if (!refitted) bvh.build(boxes);
+    spheres.update(objects, changed_objects, max_degradation);
+    for (int k : changed_objects) objects[k]->select_shading(*this);
+    changed_objects.clear();
+
+    if (!tessellation.empty() || !untessellated.empty()) build_tessellation();
+    if (!shadow_maps.empty()) build_shadow_maps(shadow_map_resolution);
+    return refitted;
+}
+
+int Scene::find_nearest_object(const Ray& ray, double& t_min) const {
+    int nearest_idx = -1;
+    t_min = 1e9;
+    bvh.traverse(ray, t_min, [&](int k) {
+        double t = objects[k]->find_ray_intersection(ray);
+        // ties go to the object listed first in the scene file
+        if (t > 0 && (t < t_min || (t == t_min && k < nearest_idx))) {
+            t_min = t;
+            nearest_idx = k;
+        }
+        return false;
+    });
+    spheres.find_nearest(ray, t_min, nearest_idx);
+    return nearest_idx;
+}
+
+bool Scene::is_obscured(const Ray& ray, double t_cur) const {
+    bool obscured = false;
+    bvh.traverse(ray, t_cur, [&](int k) {
+        double t = objects[k]->find_ray_intersection(ray);
+        if (t > EPS && t + EPS < t_cur) obscured = true;
+        return obscured;
+    });
+    return obscured || spheres.is_obscured(ray, t_cur);
+}
+
+void Scene::build_tessellation() {
+    tessellation.clear();
+    tessellation_owners.clear();
+    tessellation_errors.assign(objects.size(), 0);
+    untessellated.clear();
+    for (size_t k = 0; k < objects.size(); k++) {
+        if (!objects[k]->tessellate(tessellation, tessellation_errors[k]))
+            untessellated.push_back(k);
+        tessellation_owners.resize(tessellation.size() / 3, k);
+    }
+}
+
+void Scene::build_shadow_maps(int resolution) {
+    shadow_maps.clear();
+    shadow_map_resolution = resolution;
+    for (LightSource* ls : light_sources)
+        shadow_maps.emplace_back(new ShadowMap(*ls, tessellation,
+                                               tessellation_owners,
+                                               tessellation_errors,
+                                               resolution));
+}
+
+bool Scene::is_shadowed(int light, const Object* receiver,
+                        const Vector& point, const Vector& normal,
+                        const Ray& light_ray, double t_cur) const {
+    if (light < (int)shadow_maps.size()) {
+        switch (shadow_maps[light]->classify(point, normal, receiver,
+                                             objects)) {
+            case ShadowMap::SHADOWED:
+                return true;
+            case ShadowMap::LIT:
+                // only what the map leaves out can still be in the way
+                for (int k : untessellated) {
+                    double t = objects[k]->find_ray_intersection(light_ray);
+                    if (t > EPS && t + EPS < t_cur) return true;
+                }
+                return false;
+            case ShadowMap::UNKNOWN:
+                break;
+        }
+    }
+    return is_obscured(light_ray, t_cur);
+}
+
+int Scene::find_nearest_candidate(const Ray& ray,
+                                  const std::vector<int>& candidates,
+                                  double& t_min) const {
+    // same result as find_nearest_object: candidates are in increasing order,
+    // so a strict comparison keeps the lower index on ties
+    int nearest_idx = -1;
+    t_min = 1e9;
+    for (int k : candidates) {
+        double t = objects[k]->find_ray_intersection(ray);
+        if (t > 0 && t < t_min) {
+            t_min = t;
+            nearest_idx = k;
+        }
+    }
+    spheres.find_nearest(ray, t_min, nearest_idx);
+    return nearest_idx;
+}
+
+std::vector<PrimaryTerms> Scene::precompute_primary(const Vector& eye) const {
+    std::vector<PrimaryTerms> terms(objects.size());
+    for (size_t k = 0; k < objects.size(); k++)
+        objects[k]->precompute_primary(eye, terms[k]);
+    return terms;
+}
+
+int Scene::find_nearest_primary(const Ray& ray, double eye_distance,
+                                const std::vector<PrimaryTerms>& terms,
+                                const std::vector<int>* candidates,
+                                double& t_min) const {
+    // the same tie rules as find_nearest_object and find_nearest_candidate
+    int nearest_idx = -1;
+    t_min = 1e9;
+    if (candidates) {
+        for (int k : *candidates) {
+            double t = objects[k]->find_primary_intersection(ray, eye_distance,
+                                                             terms[k]);
+            if (t > 0 && t < t_min) {
+                t_min = t;
+                nearest_idx = k;
+            }
+        }
+    } else {
+        bvh.traverse(ray, t_min, [&](int k) {
+            double t = objects[k]->find_primary_intersection(
+                ray, eye_distance, terms[k]);
+            if (t > 0 && (t < t_min || (t == t_min && k < nearest_idx))) {
+                t_min = t;
+                nearest_idx = k;
+            }
+            return false;
+        });
+    }
+    // the sphere set has no use for the terms, it tests the spheres from the
+    // ray's origin, which may round a little differently
+    spheres.find_nearest(ray, t_min, nearest_idx);
+    return nearest_idx;
+}
+
+
+
+// Scene Cache
+
+namespace {
+
+const char SCENE_CACHE_MAGIC[8] = {'R', 'T', 'S', 'C', 'A', 'C', 'H', 'E'};
+// bump whenever any record layout or the BVH layout changes, or what loading
+// keeps of the scene and its meshes
+const uint32_t SCENE_CACHE_VERSION = 5;
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    // record sizes, so that a cache written by a differently laid out build
+    // is treated as stale instead of being misread
+    uint32_t object_size, material_size, light_size, node_size;
+    uint64_t content_hash;
+    int32_t reflection_depth, pixels;
+    uint32_t num_objects, num_materials, num_lights;
+    uint32_t num_nodes, num_indices, num_unbounded;
+    // shared by all meshes, each mesh record holds its offsets into these
+    uint32_t num_dependencies, num_prototypes;
+    uint64_t num_vertices, num_mesh_indices, num_mesh_nodes,
+        num_mesh_node_indices;
+};
+
+struct DependencyRecord {
+    uint64_t content_hash;
+    char path[248];
+};
+
+Vector vector_from(const double* p) { return Vector(p[0], p[1], p[2]); }
+
+// Read-only view of the whole cache file: a mapping where available, a plain
+// buffer otherwise
+class MappedFile {
+    const char* data_;
+    size_t size_;
+#ifdef WIN32
+    std::vector<char> buffer_;
+#endif
+
+   public:
+    MappedFile(const std::string& filename) : data_(nullptr), size_(0) {
+#ifdef WIN32
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open()) return;
+        buffer_.assign(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = (const char*)p;
+                size_ = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+    ~MappedFile() {
+#ifndef WIN32
+        if (data_) munmap((void*)data_, size_);
+#endif
+    }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+// Whether a BVH read from a cache is one BVH::build could have made over
+// num_primitives primitives: every node reached once from the root, each
+// child after its parent, leaves inside indices, every primitive index in
+// range, and no deeper than BVH::traverse's stack allows.
+bool valid_bvh(const BVH& bvh, size_t num_primitives) {
+    for (const std::vector<int32_t>* list : {&bvh.indices, &bvh.unbounded})
+        for (int32_t idx : *list)
+            if (idx < 0 || idx >= num_primitives) return false;
+    if (bvh.nodes.empty()) return true;
+
+    const int max_depth = 62;
+    std::vector<char> reached(bvh.nodes.size(), 0);
+    std::vector<std::pair<int, int>> stack = {{0, 0}};  // node and depth
+    while (!stack.empty()) {
+        int node_idx = stack.back().first, depth = stack.back().second;
+        stack.pop_back();
+        if (reached[node_idx] || depth > max_depth) return false;
+        reached[node_idx] = 1;
+        const BVHNode& node = bvh.nodes[node_idx];
+        if (node.count > 0) {
+            if (node.start < 0 || node.start > bvh.indices.size() ||
+                node.count > bvh.indices.size() - node.start)
+                return false;
+        } else {
+            if (node.count < 0 || node_idx + 1 >= bvh.nodes.size() ||
+                node.start <= node_idx + 1 || node.start >= bvh.nodes.size())
+                return false;
+            stack.push_back({node.start, depth + 1});
+            stack.push_back({node_idx + 1, depth + 1});
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+bool MaterialRecord::operator==(const MaterialRecord& m) const {
+    return memcmp(this, &m, sizeof(MaterialRecord)) == 0;
+}
+
+Object* object_from_record(const ObjectRecord& record,
+                           const MaterialRecord& material, Arena& arena) {
+    const double* p = record.params;
+    Object* object = nullptr;
+    switch (record.type) {
+        case ObjectRecord::FLOOR:
+            object = arena.create<Floor>(p[0], p[1]);
+            break;
+        case ObjectRecord::SPHERE:
+            object = arena.create<Sphere>(vector_from(p), p[3]);
+            break;
+        case ObjectRecord::TRIANGLE:
+            object = arena.create<Triangle>(vector_from(p), vector_from(p + 3),
+                                            vector_from(p + 6));
+            break;
+        case ObjectRecord::GENERAL:
+            object = arena.create<GeneralQuadraticSurface>(
+                p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9],
+                vector_from(p + 10), p[13], p[14], p[15]);
+            break;
+        case ObjectRecord::PRISM:
+            object = arena.create<Prism>(
+                vector_from(p), vector_from(p + 3), vector_from(p + 6),
+                vector_from(p + 9), vector_from(p + 12), vector_from(p + 15));
+            break;
+        default:
+            return nullptr;
+    }
+    object->set_material(material);
+    return object;
+}
+
+uint64_t hash_file(const std::string& filename) {
+    // 64-bit FNV-1a over the raw bytes
+    std::ifstream file(filename, std::ios::binary);
+    uint64_t hash = 14695981039346656037ULL;
+    char buffer[1 << 16];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        for (std::streamsize i = 0; i < file.gcount(); i++) {
+            hash ^= (unsigned char)buffer[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+bool save_scene_cache(const Scene& scene, const std::string& cache_file,
+                      uint64_t content_hash, int reflection_depth, int pixels) {
+    std::vector<DependencyRecord> dependencies;
+    for (const std::string& path : scene.dependencies) {
+        DependencyRecord record;
+        memset(&record, 0, sizeof(record));
+        if (path.size() >= sizeof(record.path)) return false;
+        memcpy(record.path, path.c_str(), path.size());
+        record.content_hash = hash_file(path);
+        dependencies.push_back(record);
+    }
+
+    std::vector<ObjectRecord> object_records;
+    std::vector<MaterialRecord> materials;
+    std::vector<double> vertices;
+    std::vector<uint32_t> mesh_indices;
+    std::vector<BVHNode> mesh_nodes;
+    std::vector<int32_t> mesh_node_indices;
+    auto append_mesh = [&](const Mesh* mesh, ObjectRecord& record) {
+        const BVH& index = mesh->get_index();
+        record.params[0] = vertices.size() / 3;
+        record.params[1] = mesh->vertices.size();
+        record.params[2] = mesh_indices.size();
+        record.params[3] = mesh->indices.size();
+        record.params[4] = mesh_nodes.size();
+        record.params[5] = index.nodes.size();
+        record.params[6] = mesh_node_indices.size();
+        record.params[7] = index.indices.size();
+        for (const Vector& v : mesh->vertices) {
+            vertices.push_back(v.x);
+            vertices.push_back(v.y);
+            vertices.push_back(v.z);
+        }
+        mesh_indices.insert(mesh_indices.end(), mesh->indices.begin(),
+                            mesh->indices.end());
+        mesh_nodes.insert(mesh_nodes.end(), index.nodes.begin(),
+                          index.nodes.end());
+        mesh_node_indices.insert(mesh_node_indices.end(),
+                                 index.indices.begin(),
+                                 index.indices.end());
+    };
+
+    // instances refer to their shared mesh by its index in this table
+    std::vector<ObjectRecord> prototype_records;
+    std::map<const Mesh*, int> prototype_index;
+    for (Object* o : scene.objects) {
+        ObjectRecord record;
+        memset(&record, 0, sizeof(record));
+        o->get_geometry(record);
+        if (record.type == ObjectRecord::MESH) {
+            append_mesh((const Mesh*)o, record);
+        } else if (record.type == ObjectRecord::INSTANCE) {
+            const Mesh* prototype = ((const Instance*)o)->prototype;
+            auto it = prototype_index.find(prototype);
+            if (it == prototype_index.end()) {
+                ObjectRecord prototype_record;
+                memset(&prototype_record, 0, sizeof(prototype_record));
+                prototype->get_geometry(prototype_record);
+                append_mesh(prototype, prototype_record);
+                it = prototype_index
+                         .insert({prototype, (int)prototype_records.size()})
+                         .first;
+                prototype_records.push_back(prototype_record);
+            }
+            record.params[16] = it->second;
+        }
+        MaterialRecord material = o->get_material();
+        auto it = std::find(materials.begin(), materials.end(), material);
+        record.material = it - materials.begin();
+        if (it == materials.end()) materials.push_back(material);
+        object_records.push_back(record);
+    }
+
+    std::vector<LightRecord> lights;
+    for (LightSource* ls : scene.light_sources) {
+        LightRecord record;
+        memset(&record, 0, sizeof(record));
+        record.type = ls->type;
+        record.position[0] = ls->light_position.x;
+        record.position[1] = ls->light_position.y;
+        record.position[2] = ls->light_position.z;
+        record.color[0] = ls->color.r;
+        record.color[1] = ls->color.g;
+        record.color[2] = ls->color.b;
+        if (ls->type == LightSource::SPOT) {
+            SpotLight* sls = (SpotLight*)ls;
+            record.direction[0] = sls->light_direction.x;
+            record.direction[1] = sls->light_direction.y;
+            record.direction[2] = sls->light_direction.z;
+            record.cutoff_angle = sls->cutoff_angle;
+        }
+        lights.push_back(record);
+    }
+
+    SceneCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_CACHE_VERSION;
+    header.header_size = sizeof(SceneCacheHeader);
+    header.object_size = sizeof(ObjectRecord);
+    header.material_size = sizeof(MaterialRecord);
+    header.light_size = sizeof(LightRecord);
+    header.node_size = sizeof(BVHNode);
+    header.content_hash = content_hash;
+    header.reflection_depth = reflection_depth;
+    header.pixels = pixels;
+    header.num_objects = object_records.size();
+    header.num_materials = materials.size();
+    header.num_lights = lights.size();
+    header.num_nodes = scene.bvh.nodes.size();
+    header.num_indices = scene.bvh.indices.size();
+    header.num_unbounded = scene.bvh.unbounded.size();
+    header.num_dependencies = dependencies.size();
+    header.num_prototypes = prototype_records.size();
+    header.num_vertices = vertices.size() / 3;
+    header.num_mesh_indices = mesh_indices.size();
+    header.num_mesh_nodes = mesh_nodes.size();
+    header.num_mesh_node_indices = mesh_node_indices.size();
+
+    // write to a temporary file and rename it over the old cache, so that a
+    // concurrent reader never sees a half written file; the name is per
+    // process as several workers may load the same scene at once
+    std::string temp_file = cache_file + ".tmp" + std::to_string(getpid());
+    std::ofstream out(temp_file, std::ios::binary);
+    if (!out.is_open()) return false;
+    auto write = [&](const void* data, size_t bytes) {
+        out.write((const char*)data, bytes);
+    };
+    write(&header, sizeof(header));
+    write(dependencies.data(), dependencies.size() * sizeof(DependencyRecord));
+    write(object_records.data(), object_records.size() * sizeof(ObjectRecord));
+    write(prototype_records.data(),
+          prototype_records.size() * sizeof(ObjectRecord));
+    write(materials.data(), materials.size() * sizeof(MaterialRecord));
+    write(lights.data(), lights.size() * sizeof(LightRecord));
+    write(scene.bvh.nodes.data(), scene.bvh.nodes.size() * sizeof(BVHNode));
+    write(vertices.data(), vertices.size() * sizeof(double));
+    write(mesh_nodes.data(), mesh_nodes.size() * sizeof(BVHNode));
+    write(scene.bvh.indices.data(), scene.bvh.indices.size() * sizeof(int32_t));
+    write(scene.bvh.unbounded.data(),
+          scene.bvh.unbounded.size() * sizeof(int32_t));
+    write(mesh_indices.data(), mesh_indices.size() * sizeof(uint32_t));
+    write(mesh_node_indices.data(), mesh_node_indices.size() * sizeof(int32_t));
+    out.close();
+    if (!out) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return std::rename(temp_file.c_str(), cache_file.c_str()) == 0;
+}
+
+bool load_scene_cache(Scene& scene, const std::string& cache_file,
+                      uint64_t content_hash, int& reflection_depth,
+                      int& pixels) {
+    MappedFile file(cache_file);
+    if (file.size() < sizeof(SceneCacheHeader)) return false;
+
+    SceneCacheHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SCENE_CACHE_VERSION ||
+        header.header_size != sizeof(SceneCacheHeader) ||
+        header.object_size != sizeof(ObjectRecord) ||
+        header.material_size != sizeof(MaterialRecord) ||
+        header.light_size != sizeof(LightRecord) ||
+        header.node_size != sizeof(BVHNode) ||
+        header.content_hash != content_hash)
+        return false;
+
+    size_t expected_size =
+        sizeof(header) +
+        header.num_dependencies * sizeof(DependencyRecord) +
+        (header.num_objects + header.num_prototypes) * sizeof(ObjectRecord) +
+        header.num_materials * sizeof(MaterialRecord) +
+        header.num_lights * sizeof(LightRecord) +
+        header.num_nodes * sizeof(BVHNode) +
+        (header.num_indices + header.num_unbounded) * sizeof(int32_t) +
+        header.num_vertices * 3 * sizeof(double) +
+        header.num_mesh_nodes * sizeof(BVHNode) +
+        header.num_mesh_indices * sizeof(uint32_t) +
+        header.num_mesh_node_indices * sizeof(int32_t);
+    if (file.size() != expected_size) return false;
+
+    // every section except the 4 byte index arrays is a multiple of 8 bytes
+    // long and the index arrays come last, so all records can be read
+    // straight from the mapping
+    const char* cursor = file.data() + sizeof(header);
+    auto section = [&](size_t bytes) {
+        const char* start = cursor;
+        cursor += bytes;
+        return start;
+    };
+    const DependencyRecord* dependencies = (const DependencyRecord*)section(
+        header.num_dependencies * sizeof(DependencyRecord));
+    for (uint32_t i = 0; i < header.num_dependencies; i++) {
+        std::string path(dependencies[i].path,
+                         strnlen(dependencies[i].path,
+                                 sizeof(dependencies[i].path)));
+        if (hash_file(path) != dependencies[i].content_hash) return false;
+    }
+    const ObjectRecord* object_records = (const ObjectRecord*)section(
+        header.num_objects * sizeof(ObjectRecord));
+    const ObjectRecord* prototype_records = (const ObjectRecord*)section(
+        header.num_prototypes * sizeof(ObjectRecord));
+    const MaterialRecord* materials = (const MaterialRecord*)section(
+        header.num_materials * sizeof(MaterialRecord));
+    const LightRecord* lights =
+        (const LightRecord*)section(header.num_lights * sizeof(LightRecord));
+    const BVHNode* nodes =
+        (const BVHNode*)section(header.num_nodes * sizeof(BVHNode));
+    const double* vertices =
+        (const double*)section(header.num_vertices * 3 * sizeof(double));
+    const BVHNode* mesh_nodes =
+        (const BVHNode*)section(header.num_mesh_nodes * sizeof(BVHNode));
+    const int32_t* indices =
+        (const int32_t*)section(header.num_indices * sizeof(int32_t));
+    const int32_t* unbounded =
+        (const int32_t*)section(header.num_unbounded * sizeof(int32_t));
+    const uint32_t* mesh_indices =
+        (const uint32_t*)section(header.num_mesh_indices * sizeof(uint32_t));
+    const int32_t* mesh_node_indices = (const int32_t*)section(
+        header.num_mesh_node_indices * sizeof(int32_t));
+
+    // a mesh record's sections must lie inside the shared arrays
+    auto make_mesh = [&](const ObjectRecord& record) -> Mesh* {
+        const double* p = record.params;
+        uint64_t limits[4] = {header.num_vertices, header.num_mesh_indices,
+                              header.num_mesh_nodes,
+                              header.num_mesh_node_indices};
+        for (int i = 0; i < 4; i++)
+            if (p[2 * i] < 0 || p[2 * i + 1] < 0 ||
+                p[2 * i] + p[2 * i + 1] > limits[i])
+                return nullptr;
+        uint64_t first_vertex = p[0], num_vertices = p[1];
+        uint64_t first_index = p[2], num_indices = p[3];
+        uint64_t first_node = p[4], num_nodes = p[5];
+        uint64_t first_node_index = p[6], num_node_indices = p[7];
+
+        std::vector<Vector> mesh_vertices(num_vertices);
+        for (uint64_t i = 0; i < num_vertices; i++) {
+            const double* v = vertices + 3 * (first_vertex + i);
+            mesh_vertices[i] = Vector(v[0], v[1], v[2]);
+        }
+        std::vector<uint32_t> indices(mesh_indices + first_index,
+                                      mesh_indices + first_index + num_indices);
+        if (num_indices % 3 != 0) return nullptr;
+        for (uint32_t idx : indices)
+            if (idx >= num_vertices) return nullptr;
+
+        BVH index;
+        index.nodes.assign(mesh_nodes + first_node,
+                           mesh_nodes + first_node + num_nodes);
+        index.indices.assign(
+            mesh_node_indices + first_node_index,
+            mesh_node_indices + first_node_index + num_node_indices);
+        if (!valid_bvh(index, num_indices / 3)) return nullptr;
+        Mesh* mesh = scene.arena.create<Mesh>(std::move(mesh_vertices),
+                                              std::move(indices));
+        mesh->set_index(index);
+        return mesh;
+    };
+
+    // anything created before a failure is released with the scene
+    std::vector<const Mesh*> prototypes;
+    for (uint32_t i = 0; i < header.num_prototypes; i++) {
+        Mesh* prototype = make_mesh(prototype_records[i]);
+        if (prototype == nullptr) return false;
+        prototypes.push_back(prototype);
+    }
+    auto make_instance = [&](const ObjectRecord& record) -> Object* {
+        int prototype = record.params[16];
+        if (prototype < 0 || prototype >= prototypes.size()) return nullptr;
+        Matrix transform;
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                transform.data[i][j] = record.params[4 * i + j];
+        return scene.arena.create<Instance>(prototypes[prototype], transform);
+    };
+
+    scene.objects.reserve(header.num_objects);
+    for (uint32_t i = 0; i < header.num_objects; i++) {
+        const ObjectRecord& record = object_records[i];
+        Object* object = nullptr;
+        if (record.material >= 0 && record.material < header.num_materials) {
+            if (record.type == ObjectRecord::MESH ||
+                record.type == ObjectRecord::INSTANCE) {
+                object = record.type == ObjectRecord::MESH
+                             ? (Object*)make_mesh(record)
+                             : make_instance(record);
+                if (object) object->set_material(materials[record.material]);
+            } else {
+                object = object_from_record(
+                    record, materials[record.material], scene.arena);
+            }
+        }
+        if (object == nullptr) return false;
+        scene.objects.push_back(object);
+    }
+
+    scene.light_sources.reserve(header.num_lights);
+    for (uint32_t i = 0; i < header.num_lights; i++) {
+        const LightRecord& l = lights[i];
+        Vector position = vector_from(l.position);
+        if (l.type == LightSource::SPOT)
+            scene.light_sources.push_back(scene.arena.create<SpotLight>(
+                position, l.color[0], l.color[1], l.color[2],
+                vector_from(l.direction), l.cutoff_angle));
+        else
+            scene.light_sources.push_back(scene.arena.create<PointLight>(
+                position, l.color[0], l.color[1], l.color[2]));
+    }
+
+    scene.bvh.nodes.assign(nodes, nodes + header.num_nodes);
+    scene.bvh.indices.assign(indices, indices + header.num_indices);
+    scene.bvh.unbounded.assign(unbounded, unbounded + header.num_unbounded);
+    if (!valid_bvh(scene.bvh, header.num_objects)) return false;
+    // the cached BVH leaves out the spheres the set takes, which are the same
+    // for the same objects
+    scene.spheres.build(scene.objects);
+
+    reflection_depth = header.reflection_depth;
+    pixels = header.pixels;
+    return true;
+}
@@ -8,24 +8,41 @@
 struct Color;
 struct PhongCoefficients;
 struct Vector;
+struct Matrix;
 struct Ray;
 struct Camera;
+struct View;
+class WorkerPool;
 class Object;
 class Sphere;
 class Triangle;
 class GeneralQuadraticSurface;
 class Prism;
+class Mesh;
+class Instance;
 class Floor;
 struct LightSource;
 struct PointLight;
 struct SpotLight;
+class Arena;
+class Scene;
+struct AABB;
+struct Frustum;
+struct PrimaryTerms;
+struct LightTerm;
+struct HitShading;
+class ShadowMap;
+class VisibilityBuffer;
+struct BVHNode;
+class BVH;
+class SphereSet;
+struct ObjectRecord;
+struct MaterialRecord;
+struct LightRecord;
 
 const double PI = 2 * acos(0.0);
 const double EPS = 1e-6;
 
-extern std::vector<Object*> objects;
-extern std::vector<LightSource*> light_sources;
-
 struct Color {
    public:
     double r, g, b;
@@ -77,6 +94,19 @@ struct Vector {
     friend std::ostream& operator<<(std::ostream& os, const Vector& v);
 };
 
+// 4x4 transformation matrix acting on column vectors
+struct Matrix {
+   public:
+    double data[4][4];
+    Matrix();  // identity
+    Matrix operator*(const Matrix& m) const;
+    Matrix transpose() const;
+    Matrix inverse() const;  // throws if the matrix is singular
+    Vector transform_point(const Vector& p) const;
+    Vector transform_direction(const Vector& d) const;  // ignores translation
+    friend std::istream& operator>>(std::istream& is, Matrix& m);  // row major
+};
+
 struct Camera {
    public:
     double speed;            // for movement operations
@@ -109,9 +139,251 @@ struct Camera {
 struct Ray {
    public:
     Vector origin, dir;
+    Ray() = default;
     Ray(const Vector& start, const Vector& dir);
 };
 
+// The pixel grid of one capture: pixel (i, j) is the centre of column i and
+// row j (from the top) of an image plane at distance 1 in front of the camera
+struct View {
+   public:
+    Camera camera;
+    int width, height;
+    double view_angle;  // vertical, in degrees
+    Vector top_left;    // centre of pixel (0, 0)
+    double du, dv;
+    View(const Camera& camera, int width, int height, double view_angle);
+    Vector pixel_position(int i, int j) const;
+    Ray primary_ray(int i, int j) const;
+    // inverse of pixel_position: the fractional column and row the point is
+    // seen at; false if the point is not in front of the camera
+    bool project(const Vector& point, double& i, double& j) const;
+};
+
+// Fixed set of threads that is reused by every render of the process
+class WorkerPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready, work_done;
+    const std::function<void(int)>* task;
+    std::atomic<int> next_task;
+    int num_tasks, busy_workers;
+    unsigned generation;
+    bool stopping;
+    void worker_loop();
+
+   public:
+    WorkerPool(unsigned num_threads);
+    ~WorkerPool();
+    int size() const;
+    // runs task(i) for every i in [0, n) on the workers and returns once all
+    // of them are done; tasks are handed out in increasing order of i
+    void parallel_for(int n, const std::function<void(int)>& task);
+};
+
+struct AABB {
+   public:
+    Vector lo, hi;
+    AABB();  // empty box, grows with expand()
+    AABB(const Vector& lo, const Vector& hi);
+    static AABB infinite();
+    bool is_empty() const;  // as made by AABB(), contains nothing
+    void expand(const Vector& p);
+    void expand(const AABB& box);
+    void pad(double amount);
+    bool is_finite() const;
+    Vector centroid() const;
+    double surface_area() const;
+    // true if the ray enters the box somewhere in [0, t_max]
+    bool intersects(const Ray& ray, double t_max) const;
+};
+
+// The part of space seen through a block of pixels of a view: between the
+// planes through the eye and the block's outer pixel edges, in front of the
+// eye and no farther along the look direction than far_distance
+struct Frustum {
+   public:
+    Vector normals[6];  // point p is inside if normals[k].dot(p) >= offsets[k]
+    double offsets[6];
+    Frustum(const View& view, int start_col, int start_row, int end_col,
+            int end_row, double far_distance);
+    // false only if no part of the box is inside; conservative otherwise
+    bool intersects(const AABB& box) const;
+};
+
+struct BVHNode {
+    // leaf: indices[start, start + count)
+    // internal (count == 0): left child is the next node, right child is start
+    AABB box;
+    int32_t start, count;
+};
+
+class BVH {
+    int max_leaf_size;
+    // for refit(), worked out from the nodes on first use: the parent of
+    // every node (-1 for the root), the leaf of every primitive (-1 if it is
+    // unbounded), the sum of the nodes' surface areas and that sum over the
+    // root's area right after the tree was built
+    std::vector<int32_t> parents, leaves;
+    double area_sum = 0, built_cost = 0;
+    int build_node(const std::vector<AABB>& boxes,
+                   std::vector<Vector>& centroids, int begin, int end);
+
+   public:
+    std::vector<BVHNode> nodes;
+    std::vector<int32_t> indices;
+    std::vector<int32_t> unbounded;  // primitives with infinite bounds
+    // primitives with empty boxes are left out, to be looked up elsewhere
+    void build(const std::vector<AABB>& boxes, int max_leaf_size = 2);
+    void clear();
+    size_t memory_used() const;  // in bytes, of the arrays
+    // Recomputes the boxes of the leaves holding the changed primitives and
+    // of every node above them, bottom up. False, and the tree is to be
+    // rebuilt, if a primitive changed between bounded and unbounded or the
+    // nodes' total surface area (the cost of traversing them) has grown past
+    // max_degradation times what it was after the last build, relative to
+    // the root's. A primitive left out of the tree has to stay left out.
+    bool refit(const std::vector<AABB>& boxes,
+               const std::vector<int>& changed, double max_degradation);
+    // like traverse(), but for every primitive whose bounds contain point
+    template <typename Visitor>
+    void query(const Vector& point, Visitor visit) const;
+    // visit(index) is called for every primitive whose bounds the ray may hit
+    // before t_max; t_max may shrink while traversing, and traversal stops as
+    // soon as visit returns true
+    template <typename Visitor>
+    void traverse(const Ray& ray, const double& t_max, Visitor visit) const;
+};
+
+template <typename Visitor>
+void BVH::traverse(const Ray& ray, const double& t_max, Visitor visit) const {
+    for (int32_t idx : unbounded)
+        if (visit(idx)) return;
+    if (nodes.empty()) return;
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode& node = nodes[node_idx];
+        if (!node.box.intersects(ray, t_max)) continue;
+        if (node.count > 0) {
+            for (int i = node.start; i < node.start + node.count; i++)
+                if (visit(indices[i])) return;
+        } else {
+            stack[top++] = node.start;
+            stack[top++] = node_idx + 1;
+        }
+    }
+}
+
+template <typename Visitor>
+void BVH::query(const Vector& point, Visitor visit) const {
+    for (int32_t idx : unbounded)
+        if (visit(idx)) return;
+    if (nodes.empty()) return;
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        int node_idx = stack[--top];
+        const BVHNode& node = nodes[node_idx];
+        const AABB& box = node.box;
+        if (point.x < box.lo.x || point.x > box.hi.x || point.y < box.lo.y ||
+            point.y > box.hi.y || point.z < box.lo.z || point.z > box.hi.z)
+            continue;
+        if (node.count > 0) {
+            for (int i = node.start; i < node.start + node.count; i++)
+                if (visit(indices[i])) return;
+        } else {
+            stack[top++] = node.start;
+            stack[top++] = node_idx + 1;
+        }
+    }
+}
+
+// Spheres tested against a ray several at a time. Particle-like scenes hold
+// thousands of spheres, which one by one would each cost a virtual call and a
+// scalar test. Here they sit in blocks of nearby spheres, the centres and
+// squared radii of a block in separate arrays, with a BVH over the blocks; a
+// ray is tested against every sphere of a block at once with SIMD
+// instructions (AVX or SSE2 where the build targets them), and the nearest
+// hit is a min reduction across the lanes. Lanes without a sphere have a NaN
+// radius, which no ray hits. The t of every lane is worked out in the same
+// order of operations as Sphere::find_ray_intersection, so the results are
+// the same bit for bit.
+class SphereSet {
+   public:
+    static const int lanes = 4;
+    struct Block {
+        double x[lanes], y[lanes], z[lanes], radius2[lanes];
+        int32_t objects[lanes];  // -1 for an empty lane
+    };
+    std::vector<Block> blocks;
+    // block * lanes + lane of every object, -1 for those not in the set
+    std::vector<int32_t> slots;
+    std::vector<AABB> block_bounds;
+    BVH bvh;  // over the blocks
+    // takes in the spheres among objects, if there are at least min_spheres
+    // of them; otherwise the set stays empty
+    void build(const std::vector<Object*>& objects, int min_spheres = 64);
+    void clear();
+    bool contains(int object) const;
+    // after some of the spheres moved; refits the BVH around them, and
+    // rebuilds the set once refitting has degraded it by more than
+    // max_degradation (see BVH::refit)
+    void update(const std::vector<Object*>& objects,
+                const std::vector<int>& changed, double max_degradation);
+    size_t memory_used() const;  // in bytes
+    // Scene::find_nearest_object over the spheres; t_min and nearest_idx hold
+    // the nearest hit found so far, if any, and are updated by the same rules
+    void find_nearest(const Ray& ray, double& t_min, int& nearest_idx) const;
+    // true if any of the spheres blocks the ray before it travels t_cur
+    bool is_obscured(const Ray& ray, double t_cur) const;
+};
+
+// Ray-triangle intersection by Cramer's rule; -1 if the ray misses
+double intersect_triangle(const Vector& a, const Vector& b, const Vector& c,
+                          const Ray& ray);
+
+// Terms of an object's intersection test that depend only on the eye. The
+// primary rays of a view all pass through the eye, so they are computed once
+// per frame and shared by every primary ray (see Object::precompute_primary).
+struct PrimaryTerms {
+   public:
+    double values[10];
+};
+
+// What one light adds to a hit, provided nothing blocks light_ray before it
+// travels t_cur
+struct LightTerm {
+   public:
+    int light;
+    Ray light_ray;  // from the light to the point
+    double t_cur;
+    Color diffuse, specular;
+};
+
+// Object::shade split into the parts that can run as separate stages: the
+// ambient term, the terms of the lights that may reach the point (each kept
+// only if its shadow ray is clear) and the reflected ray, which adds the
+// colour it sees times reflection
+struct HitShading {
+   public:
+    Vector point, normal;
+    Color ambient;
+    std::vector<LightTerm> lights;
+    double reflection;  // 0 if nothing is reflected
+    Ray reflected_ray;
+};
+
+// indices of the objects whose bounds (one box per object) may be inside the
+// frustum, in increasing order; those with an empty box are left out
+std::vector<int> cull_objects(const Frustum& frustum,
+                              const std::vector<AABB>& bounds);
+
 class Object {
    protected:
     Vector reference_point;
@@ -119,22 +391,77 @@ class Object {
     PhongCoefficients phong_coefficients;
     double red_refractive_index, green_refractive_index, blue_refractive_index;
     Vector get_reflection(const Vector& normal, const Vector& incident) const;
-    int get_next_reflection_object(Ray reflected_ray) const;
+    int get_next_reflection_object(const Scene& scene,
+                                   Ray reflected_ray) const;
     Vector get_refraction(const Vector& normal, const Vector& incident,
                           double n1, double n2) const;
+    // one instantiation of shade_with per combination of features; the one
+    // used is picked by select_shading
+    typedef void (Object::*ShadeKernel)(const Scene& scene, const Ray& ray,
+                                        Color& color, int level) const;
+    ShadeKernel shade_kernel;
+    // indices of the lights that can reach some part of the object, the only
+    // ones its shading looks at; also set by select_shading
+    std::vector<int> lights;
+    template <bool Specular, bool Reflection, bool SpotLights>
+    void shade_with(const Scene& scene, const Ray& ray, Color& color,
+                    int level) const;
+    // the term of the light for the point seen along ray; false if the light
+    // cannot add anything to it, shadowed or not, or if it is farther than
+    // range (0 for no limit)
+    template <bool Specular, bool SpotLights>
+    bool light_term(const LightSource& light, const Vector& point,
+                    const Vector& normal, const Ray& ray,
+                    const Color& local_color, double range,
+                    LightTerm& term) const;
 
    public:
     Object(const Vector& ref = Vector(0, 0, 0));
     virtual void draw() const = 0;
     virtual Vector get_normal(const Vector& point) const = 0;
     virtual Color get_color_at(const Vector& point) const;
-    virtual void shade(const Ray& ray, Color& color, int level) const;
+    virtual void shade(const Scene& scene, const Ray& ray, Color& color,
+                       int level) const;
+    // the parts of shade, for the same ray and level, without tracing any
+    // shadow or reflected ray; false if there is nothing to shade
+    virtual bool shade_hit(const Scene& scene, const Ray& ray, int level,
+                           HitShading& shading) const;
     virtual double find_ray_intersection(Ray ray) const = 0;
+    // A primary ray starts on the image plane, eye_distance away from the eye
+    // along its direction. find_primary_intersection gives the same t as
+    // find_ray_intersection for such a ray, using the terms precomputed for
+    // that eye; by default it is find_ray_intersection.
+    virtual void precompute_primary(const Vector& eye,
+                                    PrimaryTerms& terms) const;
+    virtual double find_primary_intersection(const Ray& ray,
+                                             double eye_distance,
+                                             const PrimaryTerms& terms) const;
+    virtual AABB get_bounds() const;
+    // moves the object by offset; false if it cannot be moved
+    virtual bool translate(const Vector& offset);
+    // Appends the surface as triangles, three points each, whose vertices
+    // lie on it; error is how far they may stray from the surface. False if
+    // the object cannot be tessellated.
+    virtual bool tessellate(std::vector<Vector>& triangles,
+                            double& error) const;
+    // true if the tessellation is a convex solid or a flat convex polygon,
+    // so that a ray between rays that hit it hits it too; false by default
+    virtual bool is_convex() const;
+    virtual void get_geometry(ObjectRecord& record) const = 0;
+    MaterialRecord get_material() const;
+    void set_material(const MaterialRecord& material);
     void set_color(double r, double g, double b);
     void set_shine(int shine);
     void set_coefficients(double ambient, double diffuse, double specular,
                           double reflection);
     void set_refractive_indices(double r, double g, double b);
+    // Keeps the lights of the scene that can reach the object's bounds:
+    // spot lights whose cone meets them and, with a light range, lights no
+    // farther than that. Then picks the shading kernel for the current
+    // material and those lights, leaving out the specular term and
+    // reflections when their coefficients are zero and the spot light cone
+    // when none of the lights is a spot light.
+    void select_shading(const Scene& scene);
     virtual void print() const = 0;
     virtual ~Object();
 };
@@ -147,6 +474,15 @@ class Floor : public Object {
     Vector get_normal(const Vector& point) const override;
     Color get_color_at(const Vector& pt) const override;
     double find_ray_intersection(Ray ray) const override;
+    void precompute_primary(const Vector& eye,
+                            PrimaryTerms& terms) const override;
+    double find_primary_intersection(const Ray& ray, double eye_distance,
+                                     const PrimaryTerms& terms) const override;
+    AABB get_bounds() const override;
+    bool tessellate(std::vector<Vector>& triangles,
+                    double& error) const override;
+    bool is_convex() const override;
+    void get_geometry(ObjectRecord& record) const override;
     void print() const override;
 };
 
@@ -157,6 +493,16 @@ class Sphere : public Object {
     void draw() const override;
     Vector get_normal(const Vector& point) const override;
     double find_ray_intersection(Ray ray) const override;
+    void precompute_primary(const Vector& eye,
+                            PrimaryTerms& terms) const override;
+    double find_primary_intersection(const Ray& ray, double eye_distance,
+                                     const PrimaryTerms& terms) const override;
+    AABB get_bounds() const override;
+    bool translate(const Vector& offset) override;
+    bool tessellate(std::vector<Vector>& triangles,
+                    double& error) const override;
+    bool is_convex() const override;
+    void get_geometry(ObjectRecord& record) const override;
     void print() const override;
 };
 
@@ -167,11 +513,46 @@ class Triangle : public Object {
     void draw() const override;
     Vector get_normal(const Vector& point) const override;
     double find_ray_intersection(Ray ray) const override;
+    void precompute_primary(const Vector& eye,
+                            PrimaryTerms& terms) const override;
+    double find_primary_intersection(const Ray& ray, double eye_distance,
+                                     const PrimaryTerms& terms) const override;
+    AABB get_bounds() const override;
+    bool translate(const Vector& offset) override;
+    bool tessellate(std::vector<Vector>& triangles,
+                    double& error) const override;
+    bool is_convex() const override;
+    void get_geometry(ObjectRecord& record) const override;
     void print() const override;
 };
 
 class GeneralQuadraticSurface : public Object {
     // Ax^2 + By^2 + Cz^2 + Dxy + Eyz + Fzx + Gx + Hy + Iz + J = 0
+    bool is_clipped(const Vector& point) const;
+    // the nearest of the roots t_minus, t_plus that is not clipped, or -1
+    double choose_root(const Ray& ray, double t_minus, double t_plus) const;
+    // Without cross terms the surface is
+    //   A(x - cx)^2 + B(y - cy)^2 + C(z - cz)^2 + linear . p + constant = 0
+    // around center, with linear terms only left on axes whose square term is
+    // zero. Spheres, ellipsoids, cylinders, cones and planes along the axes
+    // all take this form; classify picks the kernel that intersects it.
+    enum Shape { GENERAL, AXIS_ALIGNED, SPHERE, PLANE };
+    Shape shape;
+    Vector center, linear;
+    double constant;
+    typedef double (GeneralQuadraticSurface::*IntersectKernel)(
+        const Ray& ray) const;
+    IntersectKernel intersect_kernel;
+    void classify();
+    // the nearest root of a t^2 + 2 half_b t + c that is not clipped, less
+    // shift, or -1
+    double solve(const Ray& ray, double a, double half_b, double c,
+                 double shift) const;
+    double intersect_general(const Ray& ray) const;
+    double intersect_axis_aligned(const Ray& ray) const;
+    double intersect_sphere(const Ray& ray) const;
+    double intersect_plane(const Ray& ray) const;
+
    public:
     double A, B, C, D, E, F, G, H, I, J;
     double length, width, height;
@@ -181,6 +562,13 @@ class GeneralQuadraticSurface : public Object {
     void draw() const override;
     Vector get_normal(const Vector& point) const override;
     double find_ray_intersection(Ray ray) const override;
+    void precompute_primary(const Vector& eye,
+                            PrimaryTerms& terms) const override;
+    double find_primary_intersection(const Ray& ray, double eye_distance,
+                                     const PrimaryTerms& terms) const override;
+    AABB get_bounds() const override;
+    bool translate(const Vector& offset) override;
+    void get_geometry(ObjectRecord& record) const override;
     void print() const override;
 };
 
@@ -190,9 +578,69 @@ class Prism : public Object {
     Prism(const Vector& a, const Vector& b, const Vector& c, const Vector& d,
           const Vector& e, const Vector& f);
     void draw() const override;
-    void shade(const Ray& ray, Color& color, int level) const override;
+    void shade(const Scene& scene, const Ray& ray, Color& color,
+               int level) const override;
+    // the whole of shade, as the ambient term
+    bool shade_hit(const Scene& scene, const Ray& ray, int level,
+                   HitShading& shading) const override;
     Vector get_normal(const Vector& point) const override;
     double find_ray_intersection(Ray ray) const override;
+    AABB get_bounds() const override;
+    bool translate(const Vector& offset) override;
+    bool tessellate(std::vector<Vector>& triangles,
+                    double& error) const override;
+    void get_geometry(ObjectRecord& record) const override;
+    void print() const override;
+};
+
+// Indexed triangle mesh: one shared vertex buffer, three indices per face and
+// a single material for the whole mesh. Faces are found through a BVH of
+// their own, so a mesh is a single entry in the scene.
+class Mesh : public Object {
+    BVH face_bvh;
+    double intersect_face(int face, const Ray& ray) const;
+
+   public:
+    std::vector<Vector> vertices;
+    std::vector<uint32_t> indices;  // three per face
+    Mesh(std::vector<Vector> vertices, std::vector<uint32_t> indices);
+    void draw_faces() const;  // without setting a color
+    // Wavefront OBJ or PLY (ascii / binary), chosen by extension, created in
+    // the given arena; returns nullptr if the file cannot be read
+    static Mesh* load(const std::string& filename, Arena& arena);
+    int face_count() const;
+    void build_index();
+    const BVH& get_index() const;
+    void set_index(const BVH& bvh);
+    size_t memory_used() const;  // of the vertices, faces and index
+    void draw() const override;
+    Vector get_normal(const Vector& point) const override;
+    double find_ray_intersection(Ray ray) const override;
+    AABB get_bounds() const override;
+    bool tessellate(std::vector<Vector>& triangles,
+                    double& error) const override;
+    void get_geometry(ObjectRecord& record) const override;
+    void print() const override;
+};
+
+// A placement of a shared prototype mesh. Rays are taken into the mesh's
+// object space while intersecting, so only the transform is stored per copy.
+class Instance : public Object {
+    Matrix object_to_world, world_to_object;
+
+   public:
+    const Mesh* prototype;  // owned by the scene, like the instance itself
+    Instance(const Mesh* prototype, const Matrix& transform);
+    const Matrix& get_transform() const;
+    void set_transform(const Matrix& transform);
+    void draw() const override;
+    Vector get_normal(const Vector& point) const override;
+    double find_ray_intersection(Ray ray) const override;
+    AABB get_bounds() const override;
+    bool translate(const Vector& offset) override;
+    bool tessellate(std::vector<Vector>& triangles,
+                    double& error) const override;
+    void get_geometry(ObjectRecord& record) const override;
     void print() const override;
 };
 
@@ -217,9 +665,252 @@ struct SpotLight : public LightSource {
    public:
     Vector light_direction;
     double cutoff_angle;  // in degrees
+    double cos_cutoff;    // of the cutoff angle clamped to [0, 180]
     SpotLight(const Vector& pos, double r, double g, double b,
               const Vector& dir, double angle);
     void draw() const override;
 };
 
+// Shadow Maps
+
+// Depth of the nearest surface seen from a light, rasterized from the
+// tessellated scene: one face for a spot light whose cone fits in it, the
+// six faces of a cube otherwise. Each face is a z-buffer filled with the
+// viewing and projection transformations and the scanline conversion of the
+// rasterization assignment.
+class ShadowMap {
+    struct Face {
+        Matrix view;  // world to the light's eye space, looking down -z
+        // distance along the face's axis of the nearest surface, per texel,
+        // top row first; infinite where there is none
+        std::vector<float> depth;
+        // the triangle that surface is, -1 where there is none
+        std::vector<int32_t> triangles;
+        // over each texel as a whole, with every triangle grown by the
+        // tessellation error: the object of the nearest surface touching
+        // it (-1 for none), that object's least depth there and the least
+        // depth of any other object's, infinite where there is none
+        std::vector<int32_t> cover_owners;
+        std::vector<float> cover_depth, other_depth;
+    };
+    std::vector<Face> faces;
+    std::vector<int> owners;  // the object of every triangle
+    Vector position;  // of the light
+    int resolution;
+    double tan_half_fov, near, far;
+    double tolerance;  // the tessellation error and the depth precision
+    void rasterize(Face& face, const std::vector<Vector>& triangles,
+                   const std::vector<double>& errors);
+
+   public:
+    enum Result { LIT, SHADOWED, UNKNOWN };
+    // owners holds the object of every triangle and errors how far each
+    // object's triangles may be off, as in Scene::tessellation_owners and
+    // Scene::tessellation_errors
+    ShadowMap(const LightSource& light, const std::vector<Vector>& triangles,
+              const std::vector<int>& owners,
+              const std::vector<double>& errors, int resolution);
+    // Whether the light reaches the point, on the receiver object and a
+    // surface with the given normal: LIT if no other object touches the
+    // point's texel anywhere nearer the light than the point, and no
+    // surface is in front of the point's tangent plane at the texel centres
+    // around it; SHADOWED if one clearly is at all of those centres;
+    // UNKNOWN otherwise. Occluders at all of them only cover the point
+    // between them if they are one triangle or one convex object (see
+    // Object::is_convex); several may leave a gap there. The receiver is
+    // trusted to show any part of itself in its own way at the centres.
+    // objects are the scene's, which owners index.
+    Result classify(const Vector& point, const Vector& normal,
+                    const Object* receiver,
+                    const std::vector<Object*>& objects) const;
+    size_t memory_used() const;  // of the depth, triangle and cover buffers
+};
+
+// Visibility Buffer
+
+// Index of the object nearest the camera at every pixel of a view,
+// rasterized from the tessellated scene through the camera's own frame, so
+// that pixel centres fall where View::primary_ray aims
+class VisibilityBuffer {
+    int width, height;
+    std::vector<int> ids;  // per pixel, top row first; -1 where there is none
+    // per pixel, the least distance along the look at which the surface of
+    // any other object may be anywhere in it, allowing for the tessellation
+    // error; infinite where none may
+    std::vector<float> others;
+
+   public:
+    // far is the distance along the camera's look beyond which nothing is
+    // rasterized
+    VisibilityBuffer(const Scene& scene, const View& view, double far);
+    int id(int i, int j) const;
+    // a primary hit on the object seen at the pixel, or on one left out of
+    // the tessellation, is the nearest if it is nearer than this
+    double others_depth(int i, int j) const;
+};
+
+// Scene
+
+// Bump allocator: everything created in it is placed back to back in large
+// blocks and destroyed and released all at once by clear() or the destructor
+class Arena {
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* cursor;
+    size_t left;  // in the current block
+    size_t block_size, used;
+    // run in reverse order of creation
+    std::vector<std::pair<void*, void (*)(void*)>> destructors;
+    void* allocate(size_t size, size_t alignment);
+
+   public:
+    Arena(size_t block_size = 1 << 16);
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena();
+    template <typename T, typename... Args>
+    T* create(Args&&... args);
+    void clear();
+    size_t bytes_used() const;
+};
+
+template <typename T, typename... Args>
+T* Arena::create(Args&&... args) {
+    T* object = new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value)
+        destructors.push_back({object, [](void* p) { ((T*)p)->~T(); }});
+    return object;
+}
+
+// Everything loaded from one scene file. The objects, lights and instanced
+// meshes are created in the scene's arena, so the scene is their only owner
+// and they live exactly as long as it does.
+class Scene {
+   public:
+    Arena arena;
+    std::vector<Object*> objects;
+    std::vector<LightSource*> light_sources;
+    BVH bvh;  // over objects, see build_index()
+    // the spheres, if there are many; they are left out of bvh
+    SphereSet spheres;
+    // Files other than the scene text (meshes) that the scene was built from;
+    // the cache records their hashes and is stale if any of them changed
+    std::vector<std::string> dependencies;
+    // triangles (three points each) approximating the objects, see
+    // build_tessellation(), the object each one belongs to, and per object
+    // the farthest its triangles stray from its surface
+    std::vector<Vector> tessellation;
+    std::vector<int> tessellation_owners;
+    std::vector<double> tessellation_errors;
+    std::vector<int> untessellated;  // objects the tessellation leaves out
+    // one per light, see build_shadow_maps(); empty if there are none
+    std::vector<std::unique_ptr<ShadowMap>> shadow_maps;
+    int shadow_map_resolution = 0;
+    // objects moved or transformed since the last update_index(), and the
+    // bounds of every object as the BVH last saw them
+    std::vector<int> changed_objects;
+    std::vector<AABB> object_bounds;
+    // farthest a light reaches, 0 for no limit; set before select_shading()
+    double light_range = 0;
+
+    Scene() = default;
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+    void clear();
+    void build_index();
+    // Objects may move between captures: move_object() translates one (false
+    // if it cannot move) and object_changed() records one whose transform was
+    // set directly. update_index() then refits the BVH around them, rebuilding
+    // it instead once refitting has degraded it by more than max_degradation
+    // (see BVH::refit), and redoes the tessellation and shadow maps if there
+    // are any. It returns false if the BVH was rebuilt.
+    bool move_object(int index, const Vector& offset);
+    void object_changed(int index);
+    bool update_index(double max_degradation = 1.5);
+    // the lights and shading kernel of every object, once the lights are
+    // known; update_index() redoes it for the objects that changed
+    void select_shading();
+    // bytes taken by the objects and everything derived from them, meshes
+    // and their prototypes included
+    size_t memory_used() const;
+    // returns the index of the nearest object hit by the ray (-1 if none)
+    int find_nearest_object(const Ray& ray, double& t_min) const;
+    // true if any object blocks the ray before it travels t_cur
+    bool is_obscured(const Ray& ray, double t_cur) const;
+    // the tessellation that shadow maps and visibility buffers rasterize
+    void build_tessellation();
+    // rasterizes a shadow map of the given resolution for every light, from
+    // the tessellation
+    void build_shadow_maps(int resolution);
+    // is_obscured for the ray from light number light to point, on the
+    // receiver and a surface with the given normal, settled by the light's
+    // shadow map if it can be
+    bool is_shadowed(int light, const Object* receiver, const Vector& point,
+                     const Vector& normal, const Ray& light_ray,
+                     double t_cur) const;
+    // find_nearest_object restricted to the given objects and the sphere
+    // set, whose spheres are always tested through it and so must not be
+    // among the candidates
+    int find_nearest_candidate(const Ray& ray,
+                               const std::vector<int>& candidates,
+                               double& t_min) const;
+    // terms of every object for primary rays from the eye
+    std::vector<PrimaryTerms> precompute_primary(const Vector& eye) const;
+    // find_nearest_object (or find_nearest_candidate, if candidates are
+    // given) for a primary ray that starts eye_distance from the eye
+    int find_nearest_primary(const Ray& ray, double eye_distance,
+                             const std::vector<PrimaryTerms>& terms,
+                             const std::vector<int>* candidates,
+                             double& t_min) const;
+};
+
+// Scene Cache
+// A binary snapshot of a parsed scene, stored next to the scene file and keyed
+// by a hash of the scene text. All sections are flat arrays of the records
+// below, so loading is a single mmap followed by reading them in place.
+
+struct ObjectRecord {
+    enum Type : int32_t {
+        FLOOR,
+        SPHERE,
+        TRIANGLE,
+        GENERAL,
+        PRISM,
+        MESH,
+        INSTANCE
+    };
+    int32_t type;
+    int32_t material;   // index into the material table
+    // geometry, layout depends on type; a mesh stores the offsets and
+    // counts of its vertex, index and BVH sections here, an instance its
+    // row major transform followed by the index of its prototype
+    double params[18];
+};
+
+struct MaterialRecord {
+    double color[3];
+    double ambient, diffuse, specular, reflection;
+    int32_t shine;
+    int32_t padding;
+    double refractive_indices[3];
+    bool operator==(const MaterialRecord& m) const;
+};
+
+struct LightRecord {
+    int32_t type;  // LightSource::LightType
+    int32_t padding;
+    double position[3], color[3], direction[3];
+    double cutoff_angle;
+};
+
+Object* object_from_record(const ObjectRecord& record,
+                           const MaterialRecord& material, Arena& arena);
+uint64_t hash_file(const std::string& filename);
+bool save_scene_cache(const Scene& scene, const std::string& cache_file,
+                      uint64_t content_hash, int reflection_depth, int pixels);
+// fills an empty scene
+bool load_scene_cache(Scene& scene, const std::string& cache_file,
+                      uint64_t content_hash, int& reflection_depth,
+                      int& pixels);
+
 #endif
\ No newline at end of file
@@ -1,5 +1,14 @@
 #ifdef WIN32
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #endif
 
 #include <GL/freeglut.h>
@@ -10,7 +19,33 @@
 #include "bitmap_image.hpp"
 
 std::string input_file;
+std::string program_path;         // argv[0], to start worker processes
+std::string camera_path_file;     // --path, renders an animation headless
+std::string batch_file;           // --batch, renders every view of a job file
+std::string stream_output_file;   // --stream, renders band by band to a file
+int stream_band_rows = 64;        // --band
+int forced_width, forced_height;  // --size, overrides the scene file if set
+int num_worker_processes;         // --distribute, tiles go to child processes
+bool run_as_worker;               // --worker, serves tiles on stdin / stdout
+std::string service_socket;       // --serve, renders jobs sent to the socket
+std::string submit_socket;        // --submit, sends it the jobs on stdin
+double scene_cache_mb = 512;      // --cache-mb, scenes the service keeps
+std::string output_file_name = "Output.bmp";  // --output
+std::string regression_file;  // --regress, checks renders against goldens
+bool update_golden;           // --update-golden, rewrites them instead
+bool use_reprojection;        // --reproject, reuses hits between path frames
+bool raytraced_preview;       // toggled with 'r', ray traces the window
+double render_budget_ms;      // --budget, captures finish within it
+int crop_col, crop_row, crop_width, crop_height;  // --crop, traced alone
+std::string composite_file;  // --onto, earlier capture the crop goes into
+std::string checkpoint_file;  // --checkpoint, finished tiles survive a crash
+double checkpoint_seconds = 60;  // --checkpoint-every
+int shadow_map_resolution;    // --shadow-maps, settles most shadow rays
+bool use_hybrid_primary;      // --hybrid, rasterizes primary visibility
+bool use_wavefront;           // --wavefront, traces breadth first
+double light_range;           // --light-range, farthest a light reaches
 bool use_multithreading = true;
+bool use_scene_cache = true;  // <scene file>.cache, see load_data()
 unsigned int num_threads = std::thread::hardware_concurrency();
 
 int reflection_depth;
@@ -20,8 +55,167 @@ double far_plane_distance = 500.0;
 int captured_images;
 
 Camera camera(Vector(125, -125, 125), Vector(0, 0, 0), Vector(0, 0, 1), 2, 0.5);
-std::vector<Object *> objects;
-std::vector<LightSource *> light_sources;
+// set by load_data() and released by free_memory()
+std::unique_ptr<Scene> scene;
+
+// One row of a camera path file
+struct CameraKeyframe {
+    int frame;
+    Vector eye, look_at, up;
+};
+
+// One row of the optional object section of a camera path file: where an
+// object is at a frame, as an offset from its place in the scene file
+struct ObjectKeyframe {
+    int frame, object;
+    Vector offset;
+};
+
+// One row of a batch job file
+struct BatchView {
+    Vector eye, look_at, up;
+    double view_angle;  // vertical, in degrees
+    int width, height;
+    std::string output_file;
+};
+
+// Saves images on a background thread so that the next render can start while
+// the previous one is encoded and written. At most max_pending images wait in
+// the queue; submit() blocks beyond that, which bounds the memory in flight.
+class ImageWriter {
+    struct Job {
+        std::unique_ptr<bitmap_image> image;
+        std::string output_file;
+    };
+    std::mutex mutex;
+    std::condition_variable queue_changed;
+    std::deque<Job> pending;
+    std::vector<std::unique_ptr<bitmap_image>> free_buffers;
+    size_t max_pending;
+    bool writing, stopping;
+    double total_io_time;  // in seconds
+    std::thread io_thread;
+    void io_loop();
+
+   public:
+    ImageWriter(size_t max_pending = 2);
+    ~ImageWriter();
+    // a cleared image of the given size, recycled from earlier saves if
+    // possible
+    std::unique_ptr<bitmap_image> acquire(int width, int height);
+    void submit(std::unique_ptr<bitmap_image> image,
+                const std::string &output_file);
+    void flush();  // waits until every submitted image is on disk
+    double io_time();
+};
+
+// Reuses the primary hits of the previous frame while the camera moves in
+// small steps. Every old hit is projected into the new view, the nearest one
+// per pixel wins. Pixels that no hit lands on (disocclusions, newly visible
+// screen area), pixels next to such holes and pixels now seen from too far
+// off the direction they were shaded from are traced again; all others keep
+// their old colour.
+class ReprojectionCache {
+    struct Sample {
+        bool hit;
+        unsigned char red, green, blue;
+        Vector position;  // of the primary hit
+        Vector view_dir;  // from the eye that shaded it, normalized
+    };
+    std::vector<Sample> samples;  // of the previous frame, row major
+    const Scene *scene;
+    int width, height;
+    double min_view_cos;
+    int max_edge_contrast;
+
+   public:
+    // max_edge_contrast is the largest difference in any channel between
+    // neighbouring reused pixels
+    ReprojectionCache(double max_parallax_degrees = 1.0,
+                      int max_edge_contrast = 16);
+    void invalidate();
+    // renders the view into image and returns how many pixels were traced
+    int render(const Scene &scene, const View &view, bitmap_image &image);
+};
+
+// Traces a view breadth first rather than pixel by pixel. A batch of pixels
+// goes through stages that each run over all of its rays: the primary rays
+// are generated, then intersected, every hit is shaded into its ambient term,
+// light terms and reflected ray (see Object::shade_hit), then the shadow rays
+// are traced and the reflected rays make up the next bounce. Queues keep one
+// array per field, and rays are binned by direction and origin before they
+// are intersected so that neighbouring rays walk the same part of the BVH.
+class WavefrontRenderer {
+    // rays to intersect; what a ray sees adds to its pixel times weight
+    struct RayQueue {
+        std::vector<Vector> origins, dirs;
+        std::vector<int> pixels;
+        std::vector<double> weights;
+        void clear();
+        void push(const Vector &origin, const Vector &dir, int pixel,
+                  double weight);
+        Ray get(int k) const;
+    };
+    RayQueue rays, reflected;
+    // per ray of a bounce: its hit and, if the material reflects, the ray
+    // it reflects (reflection is 0 otherwise)
+    std::vector<int> hit_objects;
+    std::vector<double> hit_distances;
+    std::vector<Vector> hit_points, hit_normals;
+    std::vector<Vector> reflected_origins, reflected_dirs;
+    std::vector<double> reflections;
+    // per ray and light, at ray * lights + light: the light term, which is
+    // added to the ray's pixel if lit is still set once its shadow ray has
+    // been traced
+    std::vector<char> lit;
+    std::vector<Vector> shadow_dirs;
+    std::vector<double> shadow_distances;
+    std::vector<Color> diffuse, specular;
+    // rays in the order they are intersected, see bin()
+    std::vector<int> keys, order;
+    std::vector<Color> radiance;
+    std::vector<char> covered;  // pixels whose primary ray hit something
+    // the bin of a ray: the face of the cube its direction points through
+    // (4x4 cells per face), then the cell of its origin on an 8x8x8 grid
+    // over bounds
+    static int bin_key(const Vector &origin, const Vector &dir,
+                       const AABB &bounds);
+    // fills order with the indices of keys that are not -1, by bin
+    void bin();
+    void render_batch(const Scene &scene, const View &view,
+                      const std::vector<PrimaryTerms> &terms, int start_row,
+                      int end_row, bitmap_image &image);
+
+   public:
+    void render(const Scene &scene, const View &view, bitmap_image &image);
+};
+
+// The scenes the render service keeps loaded between jobs, by file name,
+// along with everything derived from them. A scene is loaded again once its
+// text or the size or modification time of a mesh it uses has changed. The
+// least recently used scenes are dropped while all of them together take
+// more than max_bytes, except for the one just asked for.
+class SceneCache {
+    struct Entry {
+        std::string file;
+        std::string stamp;  // see stamp()
+        std::unique_ptr<Scene> scene;
+        size_t bytes;
+    };
+    std::list<Entry> entries;  // most recently used first
+    size_t max_bytes, used_bytes;
+    static std::string stamp(const std::string &file,
+                             const std::vector<std::string> &dependencies);
+
+   public:
+    SceneCache(size_t max_bytes);
+    // the scene in file, loaded unless it is resident and up to date (loaded
+    // tells which); nullptr if it cannot be loaded. It stays valid until the
+    // next call.
+    const Scene *get(const std::string &file, bool &loaded);
+    int size() const;
+    size_t bytes() const;
+};
 
 // Function Declarations
 void init();
@@ -30,129 +224,2548 @@ void idle();
 void handle_keys(unsigned char key, int x, int y);
 void handle_special_keys(int key, int x, int y);
 void load_data(const std::string &filename);
-void capture();
+// the scene with everything the current settings derive from it; its
+// resolution and depth go to image_width, image_height and reflection_depth
+std::unique_ptr<Scene> load_scene(const std::string &filename);
+bool load_scene_text(Scene &scene, const std::string &filename);
+std::string resolve_path(const std::string &scene_file,
+                         const std::string &path);
+WorkerPool &get_worker_pool();
+ImageWriter &get_image_writer();
+ReprojectionCache &get_reprojection_cache();
+WavefrontRenderer &get_wavefront_renderer();
+bool trace_pixel(const Scene &scene, const View &view, int i, int j,
+                 Color &color, const std::vector<PrimaryTerms> *terms = nullptr,
+                 const std::vector<int> *candidates = nullptr,
+                 Vector *hit_point = nullptr);
+bool shade_primary_hit(const Scene &scene, const View &view, const Ray &ray,
+                       int nearest_idx, double t_min, Color &color,
+                       Vector *hit_point = nullptr);
+void render_region(const Scene &scene, const View &view, int start_col,
+                   int start_row, int end_col, int end_row,
+                   bitmap_image &image);
+void render_hybrid(const Scene &scene, const View &view, bitmap_image &image);
+void render_image(const Scene &scene, const View &view, bitmap_image &image);
+void resample(const bitmap_image &source, int source_rows,
+              bitmap_image &target);
+void render_within_budget(const Scene &scene, const View &view,
+                          double budget_ms, bitmap_image &image);
+bool render_streaming(const std::string &output_file, int band_rows);
+void render_checkpointed(const Scene &scene, const View &view,
+                         const std::string &checkpoint_file,
+                         double interval_s, bitmap_image &image);
+bool capture();
+bool load_camera_path(const std::string &filename, int &num_frames,
+                      std::vector<CameraKeyframe> &keyframes,
+                      std::vector<ObjectKeyframe> &object_keyframes);
+Camera camera_at_frame(const std::vector<CameraKeyframe> &keyframes,
+                       int frame);
+Vector offset_at_frame(const std::vector<ObjectKeyframe> &keyframes,
+                       int object, int frame);
+void render_animation(const std::string &path_file);
+bool load_batch(const std::string &filename, std::vector<BatchView> &views);
+bool render_batch(const std::string &job_file);
+std::string format_camera(const Camera &cam);
+bool parse_camera(const std::string &text, Camera &cam);
+void run_worker();
+bool render_distributed(int num_workers, const std::string &output_file);
+bool run_service(const std::string &socket_path, size_t cache_bytes);
+bool submit_jobs(const std::string &socket_path);
+bool run_regression(const std::string &manifest_file, bool update);
 void draw_axes();
+void draw_preview();
 void free_memory();
 
-void init() {
-    glClearColor(0.0f, 0.0f, 0.0f,
-                 1.0f);  // Set background color to black and opaque
+void init() {
+    glClearColor(0.0f, 0.0f, 0.0f,
+                 1.0f);  // Set background color to black and opaque
+
+    load_data(input_file);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+
+    gluPerspective(view_angle, 1.0, 1.0, far_plane_distance);
+}
+
+void draw_axes() {
+    glBegin(GL_LINES);
+    glLineWidth(20);
+    glColor3f(1, 0, 0);
+    glVertex3f(200, 0, 0);
+    glVertex3f(0, 0, 0);
+    glColor3f(0, 1, 0);
+    glVertex3f(0, 200, 0);
+    glVertex3f(0, 0, 0);
+    glColor3f(0, 0, 1);
+    glVertex3f(0, 0, 200);
+    glVertex3f(0, 0, 0);
+    glEnd();
+    glLineWidth(1);
+}
+
+WorkerPool &get_worker_pool() {
+    // created on first use so that the thread settings are already parsed
+    static WorkerPool pool(use_multithreading ? num_threads : 1);
+    return pool;
+}
+
+ImageWriter::ImageWriter(size_t max_pending)
+    : max_pending(max_pending),
+      writing(false),
+      stopping(false),
+      total_io_time(0),
+      io_thread(&ImageWriter::io_loop, this) {}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queue_changed.notify_all();
+    io_thread.join();
+}
+
+void ImageWriter::io_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        queue_changed.wait(lock, [&] { return stopping || !pending.empty(); });
+        if (pending.empty()) return;  // stopping, and nothing left to save
+        Job job = std::move(pending.front());
+        pending.pop_front();
+        writing = true;
+        lock.unlock();
+        queue_changed.notify_all();
+
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        job.image->save_image(job.output_file);
+        double time_elapsed = std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+        std::ostringstream message;
+        message << "Image saved to " << job.output_file << " in "
+                << time_elapsed << " seconds\n";
+        std::cout << message.str() << std::flush;
+
+        lock.lock();
+        total_io_time += time_elapsed;
+        free_buffers.push_back(std::move(job.image));
+        writing = false;
+        queue_changed.notify_all();
+    }
+}
+
+std::unique_ptr<bitmap_image> ImageWriter::acquire(int width, int height) {
+    std::unique_ptr<bitmap_image> image;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < free_buffers.size(); i++) {
+            if (free_buffers[i]->width() == width &&
+                free_buffers[i]->height() == height) {
+                image = std::move(free_buffers[i]);
+                free_buffers.erase(free_buffers.begin() + i);
+                break;
+            }
+        }
+        // sizes no longer in use would only pile up
+        if (!image) free_buffers.clear();
+    }
+    if (!image) image.reset(new bitmap_image(width, height));
+    image->set_all_channels(0, 0, 0);
+    return image;
+}
+
+void ImageWriter::submit(std::unique_ptr<bitmap_image> image,
+                         const std::string &output_file) {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue_changed.wait(lock, [&] { return pending.size() < max_pending; });
+    pending.push_back(Job{std::move(image), output_file});
+    lock.unlock();
+    queue_changed.notify_all();
+}
+
+void ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue_changed.wait(lock, [&] { return pending.empty() && !writing; });
+}
+
+double ImageWriter::io_time() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total_io_time;
+}
+
+ImageWriter &get_image_writer() {
+    static ImageWriter writer;
+    return writer;
+}
+
+ReprojectionCache::ReprojectionCache(double max_parallax_degrees,
+                                     int max_edge_contrast)
+    : scene(nullptr),
+      width(0),
+      height(0),
+      min_view_cos(cos(max_parallax_degrees * PI / 180)),
+      max_edge_contrast(max_edge_contrast) {}
+
+void ReprojectionCache::invalidate() {
+    samples.clear();
+    scene = nullptr;
+}
+
+int ReprojectionCache::render(const Scene &scene, const View &view,
+                              bitmap_image &image) {
+    // index of the old sample that lands on each pixel of the new view
+    std::vector<int> source(view.width * view.height, -1);
+    if (this->scene == &scene && width == view.width &&
+        height == view.height) {
+        std::vector<double> depth(source.size(), 1e18);
+        for (int k = 0; k < samples.size(); k++) {
+            const Sample &sample = samples[k];
+            double fi, fj;
+            if (!sample.hit || !view.project(sample.position, fi, fj))
+                continue;
+            if (fi < -0.5 || fi >= width - 0.5 || fj < -0.5 ||
+                fj >= height - 0.5)
+                continue;
+            int idx = (int)(fj + 0.5) * width + (int)(fi + 0.5);
+            const Camera &eye = view.camera;
+            double d = (sample.position - eye.pos).dot(eye.look);
+            if (d < depth[idx]) {
+                depth[idx] = d;
+                source[idx] = k;
+            }
+        }
+    }
+
+    auto reusable = [&](int i, int j) {
+        const int di[] = {-1, 1, 0, 0}, dj[] = {0, 0, -1, 1};
+        if (source[j * view.width + i] == -1) return false;
+        const Sample &sample = samples[source[j * view.width + i]];
+        for (int k = 0; k < 4; k++) {
+            int ni = i + di[k], nj = j + dj[k];
+            if (ni < 0 || ni >= view.width || nj < 0 || nj >= view.height)
+                continue;
+            int neighbour = source[nj * view.width + ni];
+            if (neighbour == -1) return false;
+            // a hit lands up to half a pixel off, which shows at colour edges
+            const Sample &other = samples[neighbour];
+            if (abs(other.red - sample.red) > max_edge_contrast ||
+                abs(other.green - sample.green) > max_edge_contrast ||
+                abs(other.blue - sample.blue) > max_edge_contrast)
+                return false;
+        }
+        Vector view_dir = (sample.position - view.camera.pos).normalize();
+        return view_dir.dot(sample.view_dir) >= min_view_cos;
+    };
+
+    std::vector<Sample> next(source.size());
+    std::vector<PrimaryTerms> terms = scene.precompute_primary(view.camera.pos);
+    std::atomic<int> traced(0);
+    get_worker_pool().parallel_for(view.height, [&](int j) {
+        for (int i = 0; i < view.width; i++) {
+            Sample &sample = next[j * view.width + i];
+            if (reusable(i, j)) {
+                sample = samples[source[j * view.width + i]];
+            } else {
+                Color color;
+                Vector hit_point;
+                sample.hit = trace_pixel(scene, view, i, j, color, &terms,
+                                         nullptr, &hit_point);
+                sample.red = sample.hit ? 255 * color.r : 0;
+                sample.green = sample.hit ? 255 * color.g : 0;
+                sample.blue = sample.hit ? 255 * color.b : 0;
+                sample.position = hit_point;
+                sample.view_dir = (hit_point - view.camera.pos).normalize();
+                traced++;
+            }
+            image.set_pixel(i, j, sample.red, sample.green, sample.blue);
+        }
+    });
+
+    samples.swap(next);
+    this->scene = &scene;
+    width = view.width;
+    height = view.height;
+    return traced;
+}
+
+ReprojectionCache &get_reprojection_cache() {
+    static ReprojectionCache cache;
+    return cache;
+}
+
+WavefrontRenderer &get_wavefront_renderer() {
+    static WavefrontRenderer renderer;
+    return renderer;
+}
+
+bool trace_pixel(const Scene &scene, const View &view, int i, int j,
+                 Color &color, const std::vector<PrimaryTerms> *terms,
+                 const std::vector<int> *candidates, Vector *hit_point) {
+    // Cast ray from eye to pixel
+    Ray ray = view.primary_ray(i, j);
+
+    double t_min;
+    int nearest_idx;
+    if (terms) {
+        double eye_distance = (ray.origin - view.camera.pos).norm();
+        nearest_idx = scene.find_nearest_primary(ray, eye_distance, *terms,
+                                                 candidates, t_min);
+    } else {
+        nearest_idx =
+            candidates ? scene.find_nearest_candidate(ray, *candidates, t_min)
+                       : scene.find_nearest_object(ray, t_min);
+    }
+    return shade_primary_hit(scene, view, ray, nearest_idx, t_min, color,
+                             hit_point);
+}
+
+bool shade_primary_hit(const Scene &scene, const View &view, const Ray &ray,
+                       int nearest_idx, double t_min, Color &color,
+                       Vector *hit_point) {
+    if (nearest_idx == -1) return false;
+    double dist = view.camera.look.dot(t_min * ray.dir);
+    if (dist > far_plane_distance) return false;
+    if (hit_point) *hit_point = ray.origin + ray.dir * t_min;
+    color = Color(0, 0, 0);
+    scene.objects[nearest_idx]->shade(scene, ray, color, reflection_depth);
+    color.clamp();
+    return true;
+}
+
+namespace {
+
+// square tiles are handed out to the workers one at a time, which keeps them
+// all busy even when some parts of the image are much costlier
+const int render_tile_size = 32;
+// past this many objects, the scene BVH is the cheaper way to find the
+// nearest hit of a tile than the objects in its frustum
+const int max_culled_objects = 4096;
+
+// the padded bounds of every object, which tiles cull against, and empty
+// boxes for the spheres of the sphere set, which is always tested as a
+// whole; none at all if there are too many objects to be worth it
+std::vector<AABB> culling_bounds(const Scene &scene) {
+    std::vector<AABB> bounds;
+    if (scene.objects.size() <= max_culled_objects) {
+        for (int k = 0; k < scene.objects.size(); k++) {
+            bounds.push_back(AABB());
+            if (scene.spheres.contains(k)) continue;
+            bounds.back() = scene.objects[k]->get_bounds();
+            bounds.back().pad(1e-4);
+        }
+    }
+    return bounds;
+}
+
+// pixels [tile_col, tile_end_col) x [tile_row, tile_end_row) of the view, the
+// terms of its eye precomputed; pixel (i, j) goes to (i - start_col,
+// j - start_row) of the image
+void render_tile(const Scene &scene, const View &view,
+                 const std::vector<PrimaryTerms> &terms,
+                 const std::vector<AABB> &bounds, int tile_col, int tile_row,
+                 int tile_end_col, int tile_end_row, int start_col,
+                 int start_row, bitmap_image &image) {
+    const int max_candidates = 256;
+    // primary rays of the tile only look at the objects inside its frustum;
+    // the distance of a hit is measured from the image plane, which is one
+    // unit in front of the eye
+    std::vector<int> candidates;
+    bool culled = !bounds.empty();
+    if (culled) {
+        candidates = cull_objects(Frustum(view, tile_col, tile_row,
+                                          tile_end_col, tile_end_row,
+                                          far_plane_distance + 1),
+                                  bounds);
+        culled = candidates.size() <= max_candidates;
+    }
+
+    for (int i = tile_col; i < tile_end_col; i++) {
+        for (int j = tile_row; j < tile_end_row; j++) {
+            Color color;
+            if (!trace_pixel(scene, view, i, j, color, &terms,
+                             culled ? &candidates : nullptr))
+                continue;
+            image.set_pixel(i - start_col, j - start_row, 255 * color.r,
+                            255 * color.g, 255 * color.b);
+        }
+    }
+}
+
+}  // namespace
+
+void render_region(const Scene &scene, const View &view, int start_col,
+                   int start_row, int end_col, int end_row,
+                   bitmap_image &image) {
+    // pixel (i, j) of the view goes to (i - start_col, j - start_row) of the
+    // image
+    const int tile_size = render_tile_size;
+    int tiles_x = (end_col - start_col + tile_size - 1) / tile_size;
+    int tiles_y = (end_row - start_row + tile_size - 1) / tile_size;
+    std::vector<AABB> bounds = culling_bounds(scene);
+
+    // every primary ray passes through the eye, so the parts of the
+    // intersection tests that only depend on it are worked out once here
+    std::vector<PrimaryTerms> terms = scene.precompute_primary(view.camera.pos);
+
+    get_worker_pool().parallel_for(tiles_x * tiles_y, [&](int tile) {
+        int tile_col = start_col + (tile % tiles_x) * tile_size;
+        int tile_row = start_row + (tile / tiles_x) * tile_size;
+        render_tile(scene, view, terms, bounds, tile_col, tile_row,
+                    std::min(tile_col + tile_size, end_col),
+                    std::min(tile_row + tile_size, end_row), start_col,
+                    start_row, image);
+    });
+}
+
+void render_hybrid(const Scene &scene, const View &view, bitmap_image &image) {
+    // the nearest tessellated object of every pixel comes from rasterizing
+    // the scene, so its primary ray only needs to be intersected with that
+    // object and those left out of the tessellation. The silhouettes of the
+    // tessellation and of the surfaces may differ by more than a pixel, so
+    // where another object may come nearer the pixel is traced in full.
+    // Past the far plane (one unit beyond the image plane) nothing is
+    // shown, so a little beyond it nothing needs rasterizing.
+    VisibilityBuffer visibility(scene, view, (far_plane_distance + 1) * 1.01);
+    std::vector<PrimaryTerms> terms = scene.precompute_primary(view.camera.pos);
+
+    get_worker_pool().parallel_for(view.height, [&](int j) {
+        std::vector<int> candidates;
+        for (int i = 0; i < view.width; i++) {
+            candidates = scene.untessellated;
+            // the sphere set is tested as a whole anyway
+            int seen = visibility.id(i, j);
+            if (seen != -1 && !scene.spheres.contains(seen))
+                candidates.insert(std::upper_bound(candidates.begin(),
+                                                   candidates.end(), seen),
+                                  seen);
+
+            Color color;
+            Ray ray = view.primary_ray(i, j);
+            double eye_distance = (ray.origin - view.camera.pos).norm();
+            double t_min;
+            int nearest_idx = scene.find_nearest_primary(
+                ray, eye_distance, terms, &candidates, t_min);
+            // the tessellation saw an object here that the ray misses, or
+            // another may be nearer
+            double others = visibility.others_depth(i, j);
+            bool settled =
+                nearest_idx == -1
+                    ? seen == -1 && others == INFINITY
+                    : (ray.origin + ray.dir * t_min - view.camera.pos)
+                              .dot(view.camera.look) < others;
+            bool hit = settled ? shade_primary_hit(scene, view, ray,
+                                                   nearest_idx, t_min, color)
+                               : trace_pixel(scene, view, i, j, color, &terms);
+            if (hit)
+                image.set_pixel(i, j, 255 * color.r, 255 * color.g,
+                                255 * color.b);
+        }
+    });
+}
+
+void WavefrontRenderer::RayQueue::clear() {
+    origins.clear();
+    dirs.clear();
+    pixels.clear();
+    weights.clear();
+}
+
+void WavefrontRenderer::RayQueue::push(const Vector &origin, const Vector &dir,
+                                       int pixel, double weight) {
+    origins.push_back(origin);
+    dirs.push_back(dir);
+    pixels.push_back(pixel);
+    weights.push_back(weight);
+}
+
+Ray WavefrontRenderer::RayQueue::get(int k) const {
+    // dir is normalized already, which the constructor would redo
+    Ray ray;
+    ray.origin = origins[k];
+    ray.dir = dirs[k];
+    return ray;
+}
+
+int WavefrontRenderer::bin_key(const Vector &origin, const Vector &dir,
+                               const AABB &bounds) {
+    const int face_cells = 4, origin_cells = 8;
+    auto cell = [](double value, double lo, double extent, int cells) {
+        if (!(extent > 0)) return 0;
+        return std::min(cells - 1,
+                        std::max(0, (int)((value - lo) / extent * cells)));
+    };
+    double components[] = {dir.x, dir.y, dir.z};
+    int axis = fabs(dir.x) >= fabs(dir.y) && fabs(dir.x) >= fabs(dir.z) ? 0
+               : fabs(dir.y) >= fabs(dir.z)                             ? 1
+                                                                        : 2;
+    double major = fabs(components[axis]);
+    int face = 2 * axis + (components[axis] < 0);
+    int u = cell(components[(axis + 1) % 3], -major, 2 * major, face_cells);
+    int v = cell(components[(axis + 2) % 3], -major, 2 * major, face_cells);
+    Vector extent = bounds.hi - bounds.lo;
+    int x = cell(origin.x, bounds.lo.x, extent.x, origin_cells);
+    int y = cell(origin.y, bounds.lo.y, extent.y, origin_cells);
+    int z = cell(origin.z, bounds.lo.z, extent.z, origin_cells);
+    return ((face * face_cells + u) * face_cells + v) * origin_cells *
+               origin_cells * origin_cells +
+           (x * origin_cells + y) * origin_cells + z;
+}
+
+void WavefrontRenderer::bin() {
+    // a counting sort, which keeps the rays of a bin in their order
+    const int num_bins = 6 * 4 * 4 * 8 * 8 * 8;
+    std::vector<int> starts(num_bins + 1, 0);
+    int count = 0;
+    for (int key : keys) {
+        if (key == -1) continue;
+        starts[key + 1]++;
+        count++;
+    }
+    for (int b = 0; b < num_bins; b++) starts[b + 1] += starts[b];
+    order.resize(count);
+    for (size_t k = 0; k < keys.size(); k++)
+        if (keys[k] != -1) order[starts[keys[k]]++] = k;
+}
+
+void WavefrontRenderer::render(const Scene &scene, const View &view,
+                               bitmap_image &image) {
+    // batches of whole rows bound the memory the queues take, which keeps
+    // them from pushing the scene out of the caches
+    const int batch_pixels = 1 << 14;
+    int batch_rows = std::max(1, batch_pixels / view.width);
+    std::vector<PrimaryTerms> terms = scene.precompute_primary(view.camera.pos);
+    for (int row = 0; row < view.height; row += batch_rows)
+        render_batch(scene, view, terms, row,
+                     std::min(view.height, row + batch_rows), image);
+}
+
+void WavefrontRenderer::render_batch(const Scene &scene, const View &view,
+                                     const std::vector<PrimaryTerms> &terms,
+                                     int start_row, int end_row,
+                                     bitmap_image &image) {
+    const int chunk_size = 1024;
+    int num_pixels = (end_row - start_row) * view.width;
+    int num_lights = scene.light_sources.size();
+    radiance.assign(num_pixels, Color(0, 0, 0));
+    covered.assign(num_pixels, 0);
+
+    // Generate
+    rays.clear();
+    for (int j = start_row; j < end_row; j++) {
+        for (int i = 0; i < view.width; i++) {
+            Ray ray = view.primary_ray(i, j);
+            rays.push(ray.origin, ray.dir, (j - start_row) * view.width + i, 1);
+        }
+    }
+
+    // the level of shade for the rays of this bounce
+    for (int level = reflection_depth, bounce = 0; !rays.pixels.empty();
+         level--, bounce++) {
+        int num_rays = rays.pixels.size();
+        // task(m, shading) for m in [0, n), shading being scratch space
+        auto for_chunks = [&](int n, auto task) {
+            get_worker_pool().parallel_for(
+                (n + chunk_size - 1) / chunk_size, [&](int chunk) {
+                    HitShading shading;
+                    int end = std::min(n, (chunk + 1) * chunk_size);
+                    for (int m = chunk * chunk_size; m < end; m++)
+                        task(m, shading);
+                });
+        };
+
+        // Intersect, binned
+        AABB bounds;
+        for (const Vector &origin : rays.origins) bounds.expand(origin);
+        keys.resize(num_rays);
+        for (int k = 0; k < num_rays; k++)
+            keys[k] = bin_key(rays.origins[k], rays.dirs[k], bounds);
+        bin();
+        hit_objects.resize(num_rays);
+        hit_distances.resize(num_rays);
+        for_chunks(num_rays, [&](int m, HitShading &) {
+            int k = order[m];
+            Ray ray = rays.get(k);
+            double t_min;
+            if (bounce == 0) {
+                double eye_distance = (ray.origin - view.camera.pos).norm();
+                int nearest_idx = scene.find_nearest_primary(
+                    ray, eye_distance, terms, nullptr, t_min);
+                // hits are measured from the image plane
+                if (nearest_idx != -1 &&
+                    view.camera.look.dot(t_min * ray.dir) > far_plane_distance)
+                    nearest_idx = -1;
+                hit_objects[k] = nearest_idx;
+            } else {
+                hit_objects[k] = scene.find_nearest_object(ray, t_min);
+            }
+            hit_distances[k] = t_min;
+        });
+
+        // Shade; every pixel has one ray per bounce, so no two rays add to
+        // the same pixel
+        hit_points.resize(num_rays);
+        hit_normals.resize(num_rays);
+        reflected_origins.resize(num_rays);
+        reflected_dirs.resize(num_rays);
+        reflections.assign(num_rays, 0);
+        lit.assign((size_t)num_rays * num_lights, 0);
+        shadow_dirs.resize(lit.size());
+        shadow_distances.resize(lit.size());
+        diffuse.resize(lit.size());
+        specular.resize(lit.size());
+        for_chunks(num_rays, [&](int k, HitShading &shading) {
+            if (hit_objects[k] == -1) return;
+            int pixel = rays.pixels[k];
+            if (bounce == 0) covered[pixel] = 1;
+            if (!scene.objects[hit_objects[k]]->shade_hit(scene, rays.get(k),
+                                                          level, shading))
+                return;
+            radiance[pixel] += shading.ambient * rays.weights[k];
+            hit_points[k] = shading.point;
+            hit_normals[k] = shading.normal;
+            for (const LightTerm &term : shading.lights) {
+                size_t slot = (size_t)k * num_lights + term.light;
+                lit[slot] = 1;
+                shadow_dirs[slot] = term.light_ray.dir;
+                shadow_distances[slot] = term.t_cur;
+                diffuse[slot] = term.diffuse;
+                specular[slot] = term.specular;
+            }
+            // shade at level 0 adds nothing, so neither does tracing its ray
+            if (level > 1) {
+                reflections[k] = shading.reflection;
+                reflected_origins[k] = shading.reflected_ray.origin;
+                reflected_dirs[k] = shading.reflected_ray.dir;
+            }
+        });
+
+        // Shadow rays, binned, then the terms of every pixel added in the
+        // order shade adds them
+        bounds = AABB();
+        for (LightSource *ls : scene.light_sources)
+            bounds.expand(ls->light_position);
+        keys.resize(lit.size());
+        for (size_t slot = 0; slot < lit.size(); slot++) {
+            const Vector &light_position =
+                scene.light_sources[slot % num_lights]->light_position;
+            keys[slot] = lit[slot] ? bin_key(light_position, shadow_dirs[slot],
+                                             bounds)
+                                   : -1;
+        }
+        bin();
+        for_chunks(order.size(), [&](int m, HitShading &) {
+            int slot = order[m];
+            int k = slot / num_lights, light = slot % num_lights;
+            Ray light_ray;
+            light_ray.origin = scene.light_sources[light]->light_position;
+            light_ray.dir = shadow_dirs[slot];
+            if (scene.is_shadowed(light, scene.objects[hit_objects[k]],
+                                  hit_points[k], hit_normals[k], light_ray,
+                                  shadow_distances[slot]))
+                lit[slot] = 0;
+        });
+        for_chunks(num_rays, [&](int k, HitShading &) {
+            Color &color = radiance[rays.pixels[k]];
+            double weight = rays.weights[k];
+            for (int l = 0; l < num_lights; l++) {
+                size_t slot = (size_t)k * num_lights + l;
+                if (!lit[slot]) continue;
+                color += diffuse[slot] * weight;
+                color += specular[slot] * weight;
+            }
+        });
+
+        reflected.clear();
+        for (int k = 0; k < num_rays; k++)
+            if (reflections[k] != 0)
+                reflected.push(reflected_origins[k], reflected_dirs[k],
+                               rays.pixels[k],
+                               rays.weights[k] * reflections[k]);
+        std::swap(rays, reflected);
+    }
+
+    for (int k = 0; k < num_pixels; k++) {
+        if (!covered[k]) continue;
+        Color color = radiance[k];
+        color.clamp();
+        image.set_pixel(k % view.width, start_row + k / view.width,
+                        255 * color.r, 255 * color.g, 255 * color.b);
+    }
+}
+
+void render_image(const Scene &scene, const View &view, bitmap_image &image) {
+    if (use_wavefront)
+        get_wavefront_renderer().render(scene, view, image);
+    else if (use_hybrid_primary)
+        render_hybrid(scene, view, image);
+    else
+        render_region(scene, view, 0, 0, view.width, view.height, image);
+}
+
+void resample(const bitmap_image &source, int source_rows,
+              bitmap_image &target) {
+    // each target pixel is the average of the source pixels it covers, or
+    // the nearest one if it covers less than a pixel; target rows that need
+    // source rows past source_rows are left alone
+    int64_t sw = source.width(), sh = source.height();
+    int64_t tw = target.width(), th = target.height();
+    for (int64_t y = 0; y < th; y++) {
+        int64_t y0 = y * sh / th, y1 = std::max(y0 + 1, (y + 1) * sh / th);
+        if (y1 > source_rows) break;
+        for (int64_t x = 0; x < tw; x++) {
+            int64_t x0 = x * sw / tw, x1 = std::max(x0 + 1, (x + 1) * sw / tw);
+            int sum[3] = {0, 0, 0};
+            for (int64_t j = y0; j < y1; j++) {
+                for (int64_t i = x0; i < x1; i++) {
+                    unsigned char red, green, blue;
+                    source.get_pixel(i, j, red, green, blue);
+                    sum[0] += red, sum[1] += green, sum[2] += blue;
+                }
+            }
+            int count = (y1 - y0) * (x1 - x0);
+            target.set_pixel(x, y, (sum[0] + count / 2) / count,
+                             (sum[1] + count / 2) / count,
+                             (sum[2] + count / 2) / count);
+        }
+    }
+}
+
+void render_within_budget(const Scene &scene, const View &view,
+                          double budget_ms, bitmap_image &image) {
+    // A coarse pass at an eighth of the resolution measures the time per
+    // pixel at depth 1 and at the scene's reflection depth, and is the image
+    // if nothing better fits. The rest of the budget then goes, in order of
+    // preference, to several samples per pixel at full depth, one sample at
+    // a lower depth and finally a lower resolution. The final pass runs band
+    // by band and stops before a band that would miss the deadline; the
+    // bands it leaves out keep the coarse image.
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    auto elapsed_ms = [&]() {
+        return std::chrono::duration<double, std::milli>(clock::now() - start)
+            .count();
+    };
+    const double reserve = 0.1;   // of the budget, for misestimates
+    const int max_samples = 3;    // per pixel side
+    const int band_rows = 32;
+    const int max_depth = reflection_depth;
+    int min_depth = std::min(1, max_depth);
+    int64_t pixels = (int64_t)view.width * view.height;
+
+    int coarse_width = std::max(1, view.width / 8);
+    int coarse_height = std::max(1, view.height / 8);
+    View coarse_view(view.camera, coarse_width, coarse_height,
+                     view.view_angle);
+    bitmap_image coarse(coarse_width, coarse_height);
+    reflection_depth = min_depth;
+    double before = elapsed_ms();
+    render_image(scene, coarse_view, coarse);
+    double min_cost = (elapsed_ms() - before) / coarse_width / coarse_height;
+    // the deepest depth measured; with a quarter of the budget gone, only
+    // depth 1 would fit anyway
+    int top_depth = min_depth;
+    double top_cost = min_cost;
+    if (max_depth > min_depth && elapsed_ms() < budget_ms / 4) {
+        reflection_depth = top_depth = max_depth;
+        before = elapsed_ms();
+        render_image(scene, coarse_view, coarse);
+        top_cost = (elapsed_ms() - before) / coarse_width / coarse_height;
+        // the first pass also pays for warming up, which can make the
+        // deeper one look cheaper
+        top_cost = std::max(top_cost, min_cost);
+    }
+    before = elapsed_ms();
+    resample(coarse, coarse_height, image);
+    double resample_ms = elapsed_ms() - before;
+    // time per pixel, assumed to grow linearly with the depth
+    auto cost = [&](int depth) {
+        if (top_depth == min_depth) return min_cost;
+        return min_cost + (top_cost - min_cost) * (depth - min_depth) /
+                              (top_depth - min_depth);
+    };
+
+    double left = budget_ms * (1 - reserve) - elapsed_ms();
+    int width = 0, height = 0, depth = top_depth, samples = 1;
+    for (int k = max_samples; k >= 1 && !width; k--) {
+        if (cost(top_depth) * pixels * k * k <= left)
+            width = view.width * k, height = view.height * k, samples = k;
+    }
+    for (int d = top_depth - 1; d >= min_depth && !width; d--) {
+        if (cost(d) * pixels <= left)
+            width = view.width, height = view.height, depth = d;
+    }
+    if (!width) {
+        double scale = sqrt(std::max(0.0, left) / (cost(min_depth) * pixels));
+        depth = min_depth;
+        width = view.width * scale, height = view.height * scale;
+        if (width <= coarse_width || height <= coarse_height) width = 0;
+    }
+
+    std::cout << "Budget of " << budget_ms << " ms: " << min_cost * 1000
+              << " us per pixel at depth " << min_depth;
+    if (top_depth > min_depth)
+        std::cout << ", " << top_cost * 1000 << " us at depth " << top_depth;
+    std::cout << std::endl;
+    if (!width) {
+        reflection_depth = max_depth;
+        std::cout << "Only the coarse pass fits, " << coarse_width << "x"
+                  << coarse_height << std::endl;
+        return;
+    }
+    std::cout << "Rendering " << width << "x" << height << " at depth "
+              << depth << " with " << samples * samples
+              << " sample(s) per pixel" << std::endl;
+
+    View final_view(view.camera, width, height, view.view_angle);
+    bitmap_image rendered(width, height), band(width, band_rows);
+    reflection_depth = depth;
+    // bringing the final pass to the image's size takes about as long as the
+    // coarse pass did, once per sample
+    double final_pixels = (double)width * height;
+    double deadline_ms =
+        budget_ms - resample_ms * std::max(1.0, final_pixels / pixels);
+    double band_ms = cost(depth) * width * band_rows;
+    int rows_done = 0;
+    while (rows_done < height && elapsed_ms() + band_ms <= deadline_ms) {
+        int end_row = std::min(rows_done + band_rows, height);
+        before = elapsed_ms();
+        band.clear();
+        render_region(scene, final_view, 0, rows_done, width, end_row, band);
+        for (int j = rows_done; j < end_row; j++) {
+            for (int i = 0; i < width; i++) {
+                unsigned char red, green, blue;
+                band.get_pixel(i, j - rows_done, red, green, blue);
+                rendered.set_pixel(i, j, red, green, blue);
+            }
+        }
+        band_ms = elapsed_ms() - before;
+        rows_done = end_row;
+    }
+    reflection_depth = max_depth;
+    resample(rendered, rows_done, image);
+    if (rows_done < height)
+        std::cout << "Deadline reached after " << rows_done << " of " << height
+                  << " rows, the rest is from the coarse pass" << std::endl;
+}
+
+bool render_streaming(const std::string &output_file, int band_rows) {
+    // Only one band of rows is ever in memory. BMP stores the bottom row
+    // first, so bands are rendered from the bottom of the image up and each
+    // is appended to the file as soon as it is done.
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    std::ofstream stream(output_file, std::ios::binary);
+    if (!stream) {
+        std::cerr << "Error: Could not open " << output_file << std::endl;
+        return false;
+    }
+
+    uint32_t row_size = (3 * (uint64_t)image_width + 3) & ~3ULL;
+    uint64_t image_size = (uint64_t)row_size * image_height;
+    if (image_size + 54 > UINT32_MAX) {
+        std::cerr << "Error: Image too large for a BMP file" << std::endl;
+        return false;
+    }
+
+    // 14 byte file header and 40 byte info header, little endian
+    unsigned char header[54] = {'B', 'M'};
+    auto put = [&](int offset, uint32_t value, int bytes) {
+        for (int k = 0; k < bytes; k++) header[offset + k] = value >> (8 * k);
+    };
+    put(2, 54 + image_size, 4);  // file size
+    put(10, 54, 4);              // offset of the pixel data
+    put(14, 40, 4);              // info header size
+    put(18, image_width, 4);
+    put(22, image_height, 4);
+    put(26, 1, 2);   // planes
+    put(28, 24, 2);  // bits per pixel
+    put(34, image_size, 4);
+    stream.write((const char *)header, sizeof(header));
+
+    View view(camera, image_width, image_height, view_angle);
+    band_rows = std::max(1, std::min(band_rows, image_height));
+    bitmap_image band(image_width, band_rows);
+    std::vector<char> row(row_size, 0);
+    for (int end_row = image_height; end_row > 0; end_row -= band_rows) {
+        int start_row = std::max(0, end_row - band_rows);
+        band.set_all_channels(0, 0, 0);
+        render_region(*scene, view, 0, start_row, image_width, end_row, band);
+
+        // bitmap_image keeps pixels as BGR, as BMP does
+        for (int j = end_row - 1; j >= start_row; j--) {
+            memcpy(row.data(), band.row(j - start_row), 3 * image_width);
+            stream.write(row.data(), row_size);
+        }
+    }
+
+    stream.close();
+    if (!stream) {
+        std::cerr << "Error: Could not write " << output_file << std::endl;
+        return false;
+    }
+    double time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    std::cout << "Image streamed to " << output_file << " in "
+              << time_elapsed / 1000 << " seconds" << std::endl;
+    return true;
+}
+
+// Checkpoints
+//
+// With --checkpoint, a capture keeps the tiles it has finished in a file so
+// that a render that dies part way loses little. The file is written every
+// --checkpoint-every seconds and once more when the image is done. It is
+// removed once the image is saved. A capture that finds a checkpoint of the
+// same render only traces the tiles missing from it. A checkpoint is keyed by
+// a hash of the scene file, the meshes it loads, the camera and every setting
+// that changes the pixels. It is written to a temporary file first, synced
+// and renamed over the old one, so a crash while writing never leaves a
+// broken checkpoint behind.
+//
+// Layout: CheckpointHeader, one byte per tile (1 if finished), then the BGR
+// rows of the image from the top, black where a tile is not finished.
+// Checkpointed renders always go tile by tile, even with --hybrid or
+// --wavefront.
+
+namespace {
+
+struct CheckpointHeader {
+    char magic[8];
+    uint64_t key;
+    int32_t width, height, tile_size, num_tiles;
+};
+
+const char checkpoint_magic[8] = "RTCKPT1";
+
+uint64_t checkpoint_key(const Scene &scene, const View &view) {
+    // 64-bit FNV-1a, as hash_file
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&](const void *data, size_t bytes) {
+        for (size_t k = 0; k < bytes; k++) {
+            hash ^= ((const unsigned char *)data)[k];
+            hash *= 1099511628211ULL;
+        }
+    };
+    std::vector<std::string> files = {input_file};
+    files.insert(files.end(), scene.dependencies.begin(),
+                 scene.dependencies.end());
+    for (const std::string &file : files) {
+        uint64_t content_hash = hash_file(file);
+        mix(&content_hash, sizeof(content_hash));
+    }
+    std::string camera_text = format_camera(view.camera);
+    mix(camera_text.data(), camera_text.size());
+    double settings[] = {(double)view.width,
+                         (double)view.height,
+                         view.view_angle,
+                         (double)reflection_depth,
+                         far_plane_distance,
+                         (double)shadow_map_resolution,
+                         light_range};
+    mix(settings, sizeof(settings));
+    return hash;
+}
+
+bool write_checkpoint(const std::string &file, const CheckpointHeader &header,
+                      const std::vector<char> &done,
+                      const std::vector<unsigned char> &pixels) {
+    std::string temp_file = file + ".tmp";
+    std::ofstream out(temp_file, std::ios::binary);
+    if (!out.is_open()) return false;
+    out.write((const char *)&header, sizeof(header));
+    out.write(done.data(), done.size());
+    out.write((const char *)pixels.data(), pixels.size());
+    out.close();
+    if (!out) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+#ifdef WIN32
+    return MoveFileExA(temp_file.c_str(), file.c_str(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    // the contents have to reach the disk before the rename does, or a power
+    // cut could leave the name pointing at an empty file
+    int fd = open(temp_file.c_str(), O_RDONLY);
+    bool synced = fd != -1 && fsync(fd) == 0;
+    if (fd != -1) close(fd);
+    if (!synced || rename(temp_file.c_str(), file.c_str()) != 0) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return true;
+#endif
+}
+
+// false if there is no checkpoint of the render described by expected
+bool read_checkpoint(const std::string &file, const CheckpointHeader &expected,
+                     std::vector<char> &done,
+                     std::vector<unsigned char> &pixels) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) return false;
+    CheckpointHeader header;
+    if (!in.read((char *)&header, sizeof(header)) ||
+        memcmp(&header, &expected, sizeof(header)) != 0) {
+        std::cerr << "Warning: " << file
+                  << " is a checkpoint of another render, starting over"
+                  << std::endl;
+        return false;
+    }
+    std::vector<char> read_done(done.size());
+    std::vector<unsigned char> read_pixels(pixels.size());
+    in.read(read_done.data(), read_done.size());
+    in.read((char *)read_pixels.data(), read_pixels.size());
+    if (!in) {
+        std::cerr << "Warning: " << file << " is truncated, starting over"
+                  << std::endl;
+        return false;
+    }
+    done.swap(read_done);
+    pixels.swap(read_pixels);
+    return true;
+}
+
+}  // namespace
+
+void render_checkpointed(const Scene &scene, const View &view,
+                         const std::string &checkpoint_file,
+                         double interval_s, bitmap_image &image) {
+    typedef std::chrono::steady_clock clock;
+    const int tile_size = render_tile_size;
+    int tiles_x = (view.width + tile_size - 1) / tile_size;
+    int tiles_y = (view.height + tile_size - 1) / tile_size;
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.key = checkpoint_key(scene, view);
+    header.width = view.width;
+    header.height = view.height;
+    header.tile_size = tile_size;
+    header.num_tiles = tiles_x * tiles_y;
+
+    // pixels holds the finished tiles only, so it can be written out while
+    // the others are still being traced into the image
+    size_t row_bytes = 3 * (size_t)view.width;
+    std::vector<char> done(header.num_tiles, 0);
+    std::vector<unsigned char> pixels(row_bytes * view.height, 0);
+    auto image_row = [&](int j) { return image.row(j); };
+    auto pixels_row = [&](int j) { return pixels.data() + j * row_bytes; };
+    auto copy_tile = [&](int tile, auto from_row, auto to_row) {
+        int col = (tile % tiles_x) * tile_size;
+        int row = (tile / tiles_x) * tile_size;
+        int end_col = std::min(col + tile_size, view.width);
+        int end_row = std::min(row + tile_size, view.height);
+        for (int j = row; j < end_row; j++)
+            memcpy(to_row(j) + 3 * col, from_row(j) + 3 * col,
+                   3 * (end_col - col));
+    };
+
+    std::vector<int> pending;
+    if (read_checkpoint(checkpoint_file, header, done, pixels)) {
+        for (int tile = 0; tile < header.num_tiles; tile++)
+            if (done[tile]) copy_tile(tile, pixels_row, image_row);
+        std::cout << "Resuming from " << checkpoint_file << ", "
+                  << header.num_tiles - std::count(done.begin(), done.end(), 0)
+                  << " of " << header.num_tiles << " tiles are done"
+                  << std::endl;
+    }
+    for (int tile = 0; tile < header.num_tiles; tile++)
+        if (!done[tile]) pending.push_back(tile);
+
+    std::vector<AABB> bounds = culling_bounds(scene);
+    std::vector<PrimaryTerms> terms = scene.precompute_primary(view.camera.pos);
+    std::mutex mutex;
+    bool writing = false, failed = false;
+    clock::time_point last_write = clock::now();
+    // one worker at a time writes the checkpoint, from a copy taken under
+    // the lock, while the others go on tracing
+    auto write = [&](std::unique_lock<std::mutex> &lock) {
+        writing = true;
+        std::vector<char> done_copy = done;
+        std::vector<unsigned char> pixels_copy = pixels;
+        lock.unlock();
+        bool written =
+            write_checkpoint(checkpoint_file, header, done_copy, pixels_copy);
+        lock.lock();
+        writing = false;
+        last_write = clock::now();
+        if (!written && !failed)
+            std::cerr << "Warning: Could not write checkpoint "
+                      << checkpoint_file << std::endl;
+        failed = failed || !written;
+    };
+
+    get_worker_pool().parallel_for(pending.size(), [&](int k) {
+        int tile = pending[k];
+        int tile_col = (tile % tiles_x) * tile_size;
+        int tile_row = (tile / tiles_x) * tile_size;
+        render_tile(scene, view, terms, bounds, tile_col, tile_row,
+                    std::min(tile_col + tile_size, view.width),
+                    std::min(tile_row + tile_size, view.height), 0, 0, image);
+        std::unique_lock<std::mutex> lock(mutex);
+        done[tile] = 1;
+        copy_tile(tile, image_row, pixels_row);
+        if (!writing && std::chrono::duration<double>(clock::now() -
+                                                      last_write)
+                                .count() >= interval_s)
+            write(lock);
+    });
+
+    // until the image is saved, the checkpoint is the only copy of it
+    if (!pending.empty()) {
+        std::unique_lock<std::mutex> lock(mutex);
+        write(lock);
+    }
+}
+
+bool capture() {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    ImageWriter &writer = get_image_writer();
+    View view(camera, image_width, image_height, view_angle);
+    std::unique_ptr<bitmap_image> image;
+
+    if (crop_width > 0 && crop_height > 0) {
+        // only the crop rectangle is traced, with the primary rays of the
+        // full view, so its pixels come out as in a full capture
+        int start_col = std::max(0, crop_col);
+        int start_row = std::max(0, crop_row);
+        int end_col = std::min(image_width, crop_col + crop_width);
+        int end_row = std::min(image_height, crop_row + crop_height);
+        if (start_col >= end_col || start_row >= end_row) {
+            std::cerr << "Error: Crop rectangle is outside the image"
+                      << std::endl;
+            return false;
+        }
+        std::unique_ptr<bitmap_image> crop =
+            writer.acquire(end_col - start_col, end_row - start_row);
+        render_region(*scene, view, start_col, start_row, end_col, end_row,
+                      *crop);
+
+        if (composite_file.empty()) {
+            image = std::move(crop);
+        } else {
+            image.reset(new bitmap_image(composite_file));
+            if (image->width() != image_width ||
+                image->height() != image_height) {
+                std::cerr << "Error: " << composite_file << " is not a "
+                          << image_width << "x" << image_height << " image"
+                          << std::endl;
+                return false;
+            }
+            for (int row = start_row; row < end_row; row++)
+                memcpy(image->row(row) + 3 * start_col,
+                       crop->row(row - start_row), 3 * crop->width());
+        }
+    } else {
+        image = writer.acquire(image_width, image_height);
+        if (render_budget_ms > 0)
+            render_within_budget(*scene, view, render_budget_ms, *image);
+        else if (!checkpoint_file.empty())
+            render_checkpointed(*scene, view, checkpoint_file,
+                                checkpoint_seconds, *image);
+        else
+            render_image(*scene, view, *image);
+    }
+
+    std::string output_file =
+        "Output_1" + std::to_string(++captured_images) + ".bmp";
+
+    // the time reported here is render time only, the writer reports the
+    // time it spends saving the image
+    double time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    writer.submit(std::move(image), output_file);
+    std::cout << "Image captured to " << output_file << " in "
+              << time_elapsed / 1000 << " seconds" << std::endl;
+    if (!checkpoint_file.empty() && render_budget_ms <= 0 && crop_width <= 0) {
+        // the checkpoint is only dropped once the image is safely saved
+        writer.flush();
+        if (std::ifstream(output_file).good())
+            std::remove(checkpoint_file.c_str());
+    }
+    return true;
+}
+
+bool load_camera_path(const std::string &filename, int &num_frames,
+                      std::vector<CameraKeyframe> &keyframes,
+                      std::vector<ObjectKeyframe> &object_keyframes) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Camera path file not found" << std::endl;
+        return false;
+    }
+
+    int num_keyframes;
+    file >> num_frames >> num_keyframes;
+    for (int i = 0; i < num_keyframes; i++) {
+        CameraKeyframe keyframe;
+        file >> keyframe.frame >> keyframe.eye >> keyframe.look_at >>
+            keyframe.up;
+        keyframes.push_back(keyframe);
+    }
+    if (!file || num_frames <= 0 || keyframes.empty()) {
+        std::cerr << "Error reading camera path file" << std::endl;
+        return false;
+    }
+
+    std::sort(keyframes.begin(), keyframes.end(),
+              [](const CameraKeyframe &a, const CameraKeyframe &b) {
+                  return a.frame < b.frame;
+              });
+
+    // the object section is optional; anything else after the camera
+    // keyframes is taken as comments
+    int num_object_keyframes;
+    if (file >> num_object_keyframes) {
+        for (int i = 0; i < num_object_keyframes; i++) {
+            ObjectKeyframe keyframe;
+            file >> keyframe.frame >> keyframe.object >> keyframe.offset;
+            if (!file || keyframe.object < 0) {
+                std::cerr << "Error reading object keyframes" << std::endl;
+                return false;
+            }
+            object_keyframes.push_back(keyframe);
+        }
+        std::sort(object_keyframes.begin(), object_keyframes.end(),
+                  [](const ObjectKeyframe &a, const ObjectKeyframe &b) {
+                      return a.object != b.object ? a.object < b.object
+                                                  : a.frame < b.frame;
+                  });
+    }
+    file.close();
+    return true;
+}
+
+Camera camera_at_frame(const std::vector<CameraKeyframe> &keyframes,
+                       int frame) {
+    // hold the first / last keyframe outside their range, interpolate
+    // linearly in between
+    const CameraKeyframe *from = &keyframes.front(), *to = &keyframes.front();
+    for (const CameraKeyframe &keyframe : keyframes) {
+        to = &keyframe;
+        if (keyframe.frame >= frame) break;
+        from = &keyframe;
+    }
+    double s = 0;
+    if (to->frame > from->frame)
+        s = std::min(1.0, std::max(0.0, double(frame - from->frame) /
+                                            (to->frame - from->frame)));
+
+    Vector eye = from->eye + (to->eye - from->eye) * s;
+    Vector look_at = from->look_at + (to->look_at - from->look_at) * s;
+    Vector up = from->up + (to->up - from->up) * s;
+    return Camera(eye, look_at, up, camera.speed, camera.rotation_speed);
+}
+
+Vector offset_at_frame(const std::vector<ObjectKeyframe> &keyframes,
+                       int object, int frame) {
+    // interpolated like the camera, between the object's own keyframes
+    const ObjectKeyframe *from = nullptr, *to = nullptr;
+    for (const ObjectKeyframe &keyframe : keyframes) {
+        if (keyframe.object != object) continue;
+        if (!from) from = &keyframe;
+        to = &keyframe;
+        if (keyframe.frame >= frame) break;
+        from = &keyframe;
+    }
+    if (!from) return Vector(0, 0, 0);
+    double s = 0;
+    if (to->frame > from->frame)
+        s = std::min(1.0, std::max(0.0, double(frame - from->frame) /
+                                            (to->frame - from->frame)));
+    return from->offset + (to->offset - from->offset) * s;
+}
+
+void render_animation(const std::string &path_file) {
+    int num_frames;
+    std::vector<CameraKeyframe> keyframes;
+    std::vector<ObjectKeyframe> object_keyframes;
+    if (!load_camera_path(path_file, num_frames, keyframes, object_keyframes))
+        return;
+
+    // objects that move, with the offset they have been moved by so far;
+    // between frames they are moved and the BVH refitted around them
+    std::map<int, Vector> moving;
+    for (const ObjectKeyframe &keyframe : object_keyframes) {
+        if (keyframe.object >= (int)scene->objects.size()) {
+            std::cerr << "Warning: No object " << keyframe.object
+                      << " to move" << std::endl;
+            continue;
+        }
+        moving[keyframe.object] = Vector(0, 0, 0);
+    }
+    int index_rebuilds = 0;
+
+    // the scene, its BVH, the worker threads and the image buffers are all
+    // set up once and reused by every frame; frame N is saved by the image
+    // writer while frame N + 1 renders
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    ImageWriter &writer = get_image_writer();
+    double io_time_before = writer.io_time();
+    double render_time = 0;
+    long long traced_pixels = 0;
+    for (int frame = 0; frame < num_frames; frame++) {
+        std::chrono::steady_clock::time_point frame_start =
+            std::chrono::steady_clock::now();
+
+        bool moved = false;
+        for (auto it = moving.begin(); it != moving.end();) {
+            Vector offset = offset_at_frame(object_keyframes, it->first, frame);
+            Vector step = offset - it->second;
+            if (step.x == 0 && step.y == 0 && step.z == 0) {
+                ++it;
+            } else if (scene->move_object(it->first, step)) {
+                it->second = offset;
+                moved = true;
+                ++it;
+            } else {
+                std::cerr << "Warning: Object " << it->first
+                          << " cannot be moved" << std::endl;
+                it = moving.erase(it);
+            }
+        }
+        if (moved) {
+            if (!scene->update_index()) index_rebuilds++;
+            get_reprojection_cache().invalidate();
+        }
+
+        std::unique_ptr<bitmap_image> image =
+            writer.acquire(image_width, image_height);
+        View view(camera_at_frame(keyframes, frame), image_width,
+                  image_height, view_angle);
+        if (use_reprojection)
+            traced_pixels +=
+                get_reprojection_cache().render(*scene, view, *image);
+        else
+            render_image(*scene, view, *image);
+
+        double frame_time =
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - frame_start)
+                .count();
+        render_time += frame_time / 1000;
+
+        char output_file[32];
+        snprintf(output_file, sizeof(output_file), "Output_%05d.bmp", frame);
+        writer.submit(std::move(image), output_file);
+        std::cout << "Frame " << frame + 1 << "/" << num_frames
+                  << " rendered in " << frame_time / 1000 << " seconds"
+                  << std::endl;
+    }
+    writer.flush();
+    double time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    std::cout << num_frames << " frames done in " << time_elapsed / 1000
+              << " seconds (render " << render_time << " seconds, I/O "
+              << writer.io_time() - io_time_before
+              << " seconds in the background)" << std::endl;
+    if (use_reprojection)
+        std::cout << 100.0 * traced_pixels /
+                         ((double)num_frames * image_width * image_height)
+                  << "% of the pixels traced, the rest reprojected"
+                  << std::endl;
+    if (!moving.empty())
+        std::cout << moving.size() << " objects moved, the BVH refitted "
+                  << "around them and rebuilt " << index_rebuilds << " times"
+                  << std::endl;
+}
+
+bool load_batch(const std::string &filename, std::vector<BatchView> &views) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Batch job file not found" << std::endl;
+        return false;
+    }
+    int num_views = 0;
+    file >> num_views;
+    for (int i = 0; i < num_views; i++) {
+        BatchView view;
+        file >> view.eye >> view.look_at >> view.up >> view.view_angle >>
+            view.width >> view.height >> view.output_file;
+        if (!file || view.width <= 0 || view.height <= 0 ||
+            view.view_angle <= 0 || view.view_angle >= 180)
+            break;
+        views.push_back(view);
+    }
+    if (num_views <= 0 || views.size() != num_views) {
+        std::cerr << "Error reading batch job file" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool render_batch(const std::string &job_file) {
+    std::vector<BatchView> jobs;
+    if (!load_batch(job_file, jobs)) return false;
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    ImageWriter &writer = get_image_writer();
+    std::vector<View> views;
+    std::vector<std::unique_ptr<bitmap_image>> images;
+    for (const BatchView &job : jobs) {
+        views.push_back(View(Camera(job.eye, job.look_at, job.up, camera.speed,
+                                    camera.rotation_speed),
+                             job.width, job.height, job.view_angle));
+        images.push_back(writer.acquire(job.width, job.height));
+    }
+    std::vector<double> finish_times(jobs.size());  // in seconds
+    auto finish = [&](int v) {
+        writer.submit(std::move(images[v]), jobs[v].output_file);
+        finish_times[v] = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    };
+
+    if (use_wavefront || use_hybrid_primary) {
+        // these renderers go over a whole view at a time
+        for (int v = 0; v < views.size(); v++) {
+            render_image(*scene, views[v], *images[v]);
+            finish(v);
+        }
+    } else {
+        // The tiles of all views go to the workers as one list, view after
+        // view, so that the workers move on to the next view while the last
+        // tiles of one are still being rendered; whoever finishes the last
+        // tile of a view hands it to the image writer.
+        const int tile_size = render_tile_size;
+        std::vector<AABB> bounds = culling_bounds(*scene);
+        std::vector<std::vector<PrimaryTerms>> terms;
+        std::vector<int> first_tile = {0}, tiles_x;
+        for (const View &view : views) {
+            terms.push_back(scene->precompute_primary(view.camera.pos));
+            tiles_x.push_back((view.width + tile_size - 1) / tile_size);
+            first_tile.push_back(
+                first_tile.back() +
+                tiles_x.back() * ((view.height + tile_size - 1) / tile_size));
+        }
+        std::unique_ptr<std::atomic<int>[]> tiles_left(
+            new std::atomic<int>[views.size()]);
+        for (int v = 0; v < views.size(); v++)
+            tiles_left[v] = first_tile[v + 1] - first_tile[v];
+
+        get_worker_pool().parallel_for(first_tile.back(), [&](int tile) {
+            int v = std::upper_bound(first_tile.begin(), first_tile.end(),
+                                     tile) -
+                    first_tile.begin() - 1;
+            const View &view = views[v];
+            int k = tile - first_tile[v];
+            int tile_col = (k % tiles_x[v]) * tile_size;
+            int tile_row = (k / tiles_x[v]) * tile_size;
+            render_tile(*scene, view, terms[v], bounds, tile_col, tile_row,
+                        std::min(tile_col + tile_size, view.width),
+                        std::min(tile_row + tile_size, view.height), 0, 0,
+                        *images[v]);
+            if (--tiles_left[v] == 0) finish(v);
+        });
+    }
+    writer.flush();
+
+    double time_elapsed = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    for (int v = 0; v < jobs.size(); v++)
+        std::cout << jobs[v].output_file << " (" << jobs[v].width << "x"
+                  << jobs[v].height << ") done after " << finish_times[v]
+                  << " seconds" << std::endl;
+    std::cout << jobs.size() << " views rendered in " << time_elapsed
+              << " seconds" << std::endl;
+    return true;
+}
+
+// Distributed Rendering
+//
+// The coordinator splits the image into tiles and hands them to worker
+// processes (this program started with --worker) over pipes. Each worker
+// loads the scene once and then renders tiles until it is told to quit.
+// Messages are text lines, except for the pixels that follow "done":
+//   coordinator -> worker: camera <pos> <look> <up> <right>
+//                          tile <id> <start col> <start row> <end col>
+//                               <end row>
+//                          quit
+//   worker -> coordinator: done <id> <bytes>, then the tile's BGR pixels
+// Only byte streams are needed, so workers could as well sit behind sockets.
+
+std::string format_camera(const Camera &cam) {
+    // hex floats, so the workers get exactly the same camera
+    std::string text = "camera";
+    for (const Vector *v : {&cam.pos, &cam.look, &cam.up, &cam.right}) {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), " %a %a %a", v->x, v->y, v->z);
+        text += buffer;
+    }
+    return text;
+}
+
+bool parse_camera(const std::string &text, Camera &cam) {
+    std::istringstream words(text);
+    std::string word;
+    words >> word;
+    if (word != "camera") return false;
+    for (Vector *v : {&cam.pos, &cam.look, &cam.up, &cam.right}) {
+        double *components[] = {&v->x, &v->y, &v->z};
+        for (double *c : components) {
+            if (!(words >> word)) return false;
+            *c = strtod(word.c_str(), nullptr);
+        }
+    }
+    return true;
+}
+
+void run_worker() {
+    View view(camera, image_width, image_height, view_angle);
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::istringstream words(line);
+        std::string command;
+        words >> command;
+        if (command == "camera") {
+            if (parse_camera(line, camera))
+                view = View(camera, image_width, image_height, view_angle);
+        } else if (command == "tile") {
+            int id, start_col, start_row, end_col, end_row;
+            words >> id >> start_col >> start_row >> end_col >> end_row;
+            int width = end_col - start_col, height = end_row - start_row;
+            bitmap_image tile(width, height);
+            tile.set_all_channels(0, 0, 0);
+            render_region(*scene, view, start_col, start_row, end_col, end_row,
+                          tile);
+
+            std::cout << "done " << id << " " << 3 * width * height << "\n";
+            for (int row = 0; row < height; row++)
+                std::cout.write((const char *)tile.row(row), 3 * width);
+            std::cout.flush();
+        } else if (command == "quit") {
+            break;
+        }
+    }
+}
+
+#ifdef WIN32
+bool render_distributed(int num_workers, const std::string &output_file) {
+    std::cerr << "Error: Distributed rendering needs a POSIX system"
+              << std::endl;
+    return false;
+}
+#else
+namespace {
 
-    load_data(input_file);
+struct WorkerProcess {
+    pid_t pid;
+    int to_worker, from_worker;
+    bool alive;
+    int tile;  // -1 while idle
+    std::chrono::steady_clock::time_point tile_start;
+    std::string header;  // "done" line being read
+    std::vector<char> pixels;
+    size_t pixel_bytes;  // expected size of pixels, 0 while reading header
+    int tiles_done;
+};
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+struct Tile {
+    int start_col, start_row, end_col, end_row;
+    bool done;
+    int copies;  // workers currently rendering it
+};
 
-    gluPerspective(view_angle, 1.0, 1.0, far_plane_distance);
+bool start_worker(WorkerProcess &worker, const std::vector<std::string> &args) {
+    int to_child[2], from_child[2];
+    if (pipe(to_child) != 0) return false;
+    if (pipe(from_child) != 0) {
+        close(to_child[0]), close(to_child[1]);
+        return false;
+    }
+    // none of these may leak into the other workers
+    for (int fd : {to_child[0], to_child[1], from_child[0], from_child[1]})
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        std::vector<char *> argv;
+        for (const std::string &arg : args) argv.push_back((char *)arg.c_str());
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    if (pid < 0) {
+        close(to_child[1]);
+        close(from_child[0]);
+        return false;
+    }
+    worker.pid = pid;
+    worker.to_worker = to_child[1];
+    worker.from_worker = from_child[0];
+    worker.alive = true;
+    worker.tile = -1;
+    worker.pixel_bytes = 0;
+    worker.tiles_done = 0;
+    return true;
 }
 
-void draw_axes() {
-    glBegin(GL_LINES);
-    glLineWidth(20);
-    glColor3f(1, 0, 0);
-    glVertex3f(200, 0, 0);
-    glVertex3f(0, 0, 0);
-    glColor3f(0, 1, 0);
-    glVertex3f(0, 200, 0);
-    glVertex3f(0, 0, 0);
-    glColor3f(0, 0, 1);
-    glVertex3f(0, 0, 200);
-    glVertex3f(0, 0, 0);
-    glEnd();
-    glLineWidth(1);
+bool send_line(WorkerProcess &worker, const std::string &line) {
+    std::string message = line + "\n";
+    const char *data = message.c_str();
+    size_t left = message.size();
+    while (left > 0) {
+        ssize_t written = write(worker.to_worker, data, left);
+        if (written <= 0) return false;
+        data += written;
+        left -= written;
+    }
+    return true;
 }
 
-void capture() {
+}  // namespace
+
+bool render_distributed(int num_workers, const std::string &output_file) {
     std::chrono::steady_clock::time_point start =
         std::chrono::steady_clock::now();
+    signal(SIGPIPE, SIG_IGN);  // a dead worker shows up as a failed write
+
+    char exe[4096];
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    std::string executable =
+        length > 0 ? std::string(exe, length) : program_path;
+    unsigned threads_per_worker = std::max(1u, num_threads / num_workers);
+    std::vector<std::string> args = {executable,
+                                     "--worker",
+                                     input_file,
+                                     "--size",
+                                     std::to_string(image_width),
+                                     std::to_string(image_height),
+                                     "--threads",
+                                     std::to_string(threads_per_worker)};
+    if (shadow_map_resolution > 0) {
+        args.push_back("--shadow-maps");
+        args.push_back(std::to_string(shadow_map_resolution));
+    }
+    if (light_range > 0) {
+        // a hex float, like the camera, so the workers cut off exactly here
+        char range[64];
+        snprintf(range, sizeof(range), "%a", light_range);
+        args.push_back("--light-range");
+        args.push_back(range);
+    }
+
+    std::vector<WorkerProcess> workers(num_workers);
+    for (WorkerProcess &worker : workers) {
+        if (!start_worker(worker, args)) {
+            std::cerr << "Error: Could not start a worker process"
+                      << std::endl;
+            worker.alive = false;
+            continue;
+        }
+        if (!send_line(worker, format_camera(camera))) worker.alive = false;
+    }
+
+    const int tile_size = 64;
+    std::vector<Tile> tiles;
+    for (int row = 0; row < image_height; row += tile_size)
+        for (int col = 0; col < image_width; col += tile_size)
+            tiles.push_back(Tile{col, row,
+                                 std::min(col + tile_size, image_width),
+                                 std::min(row + tile_size, image_height),
+                                 false, 0});
+    std::deque<int> pending;
+    for (int i = 0; i < tiles.size(); i++) pending.push_back(i);
+
     bitmap_image image(image_width, image_height);
     image.set_all_channels(0, 0, 0);
+    std::vector<double> tile_times;  // of finished tiles, in seconds
+    int tiles_done = 0, reassigned = 0;
 
-    // plane_distance is the distance from the camera to the image plane
-    double plane_distance = 1.0;
-    double window_height = 2 * tan(view_angle * PI / 360.0) * plane_distance;
-    double window_width = window_height;
-    Vector top_left = camera.pos + plane_distance * camera.look -
-                      (window_width / 2.0) * camera.right +
-                      (window_height / 2.0) * camera.up;
-    double du = window_width / image_width;
-    double dv = window_height / image_height;
-
-    // Choose middle of the grid cell
-    top_left += 0.5 * du * camera.right - 0.5 * dv * camera.up;
-
-    auto render_segment = [&](int start_col, int end_col) {
-        for (int i = start_col; i < end_col; i++) {
-            for (int j = 0; j < image_height; j++) {
-                // Calculate current pixel
-                Vector cur_pixel =
-                    top_left + i * du * camera.right - j * dv * camera.up;
-
-                // Cast ray from eye to pixel
-                Ray ray(cur_pixel, cur_pixel - camera.pos);
-
-                int nearest_idx = -1;
-                double t_min = 1e9;
-                for (int k = 0; k < objects.size(); k++) {
-                    Object *o = objects[k];
-                    double t = o->find_ray_intersection(ray);
-                    if (t > 0 && t < t_min) {
-                        t_min = t;
-                        nearest_idx = k;
-                    }
-                }
+    auto lose_worker = [&](WorkerProcess &worker) {
+        if (!worker.alive) return;
+        worker.alive = false;
+        close(worker.to_worker);
+        close(worker.from_worker);
+        if (worker.tile != -1) {
+            Tile &tile = tiles[worker.tile];
+            tile.copies--;
+            if (!tile.done && tile.copies == 0) {
+                pending.push_front(worker.tile);
+                reassigned++;
+            }
+        }
+        worker.tile = -1;
+    };
 
-                if (nearest_idx == -1) continue;
-                double dist = camera.look.dot(t_min * ray.dir);
-                if (dist > far_plane_distance) continue;
-                Color color(0, 0, 0);
-                objects[nearest_idx]->shade(ray, color, reflection_depth);
-                color.clamp();
+    // asks the workers still running to quit, or with abandon kills them,
+    // and reaps them all
+    auto stop_workers = [&](bool abandon) {
+        for (WorkerProcess &worker : workers) {
+            if (!worker.alive) continue;
+            if (!abandon) send_line(worker, "quit");
+            // a worker still on a duplicated tile would only finish it for
+            // nothing
+            if (abandon || worker.tile != -1) kill(worker.pid, SIGKILL);
+            lose_worker(worker);
+        }
+        for (WorkerProcess &worker : workers)
+            if (worker.pid > 0) waitpid(worker.pid, nullptr, 0);
+    };
 
-                image.set_pixel(i, j, 255 * color.r, 255 * color.g,
-                                255 * color.b);
-            }
+    auto assign = [&](WorkerProcess &worker, int tile_idx) {
+        Tile &tile = tiles[tile_idx];
+        std::ostringstream command;
+        command << "tile " << tile_idx << " " << tile.start_col << " "
+                << tile.start_row << " " << tile.end_col << " "
+                << tile.end_row;
+        worker.tile = tile_idx;
+        worker.tile_start = std::chrono::steady_clock::now();
+        tile.copies++;
+        if (!send_line(worker, command.str())) lose_worker(worker);
+    };
+
+    auto finish_tile = [&](WorkerProcess &worker) {
+        Tile &tile = tiles[worker.tile];
+        tile.copies--;
+        int width = tile.end_col - tile.start_col;
+        if (!tile.done && worker.pixels.size() ==
+                              3 * width * (tile.end_row - tile.start_row)) {
+            const char *pixels = worker.pixels.data();
+            for (int row = tile.start_row; row < tile.end_row; row++)
+                memcpy(image.row(row) + 3 * tile.start_col,
+                       pixels + 3 * width * (row - tile.start_row), 3 * width);
+            tile.done = true;
+            tiles_done++;
+            worker.tiles_done++;
+            tile_times.push_back(std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() -
+                                     worker.tile_start)
+                                     .count());
         }
+        worker.tile = -1;
     };
 
-    if (use_multithreading && num_threads > 1) {
-        std::vector<std::thread> threads;
-        int cols_per_thread = image_width / num_threads;
-        for (int i = 0; i < num_threads; i++) {
-            int start_col = i * cols_per_thread;
-            int end_col = (i == num_threads - 1) ? image_width
-                                                 : (i + 1) * cols_per_thread;
-            threads.push_back(std::thread(render_segment, start_col, end_col));
+    while (tiles_done < tiles.size()) {
+        // a tile that takes much longer than usual is given to an idle
+        // worker as well, whichever copy finishes first is used
+        double slow_after = 1e18;
+        if (!tile_times.empty()) {
+            std::vector<double> times = tile_times;
+            std::nth_element(times.begin(), times.begin() + times.size() / 2,
+                             times.end());
+            slow_after = std::max(1.0, 4 * times[times.size() / 2]);
+        }
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+
+        for (WorkerProcess &worker : workers) {
+            if (!worker.alive || worker.tile != -1) continue;
+            if (!pending.empty()) {
+                int tile_idx = pending.front();
+                pending.pop_front();
+                if (!tiles[tile_idx].done) assign(worker, tile_idx);
+                continue;
+            }
+            for (WorkerProcess &other : workers) {
+                if (!other.alive || other.tile == -1) continue;
+                const Tile &tile = tiles[other.tile];
+                double running = std::chrono::duration<double>(
+                                     now - other.tile_start)
+                                     .count();
+                if (!tile.done && tile.copies == 1 && running > slow_after) {
+                    assign(worker, other.tile);
+                    reassigned++;
+                    break;
+                }
+            }
+        }
+
+        std::vector<pollfd> fds;
+        std::vector<WorkerProcess *> polled;
+        for (WorkerProcess &worker : workers) {
+            if (!worker.alive) continue;
+            fds.push_back(pollfd{worker.from_worker, POLLIN, 0});
+            polled.push_back(&worker);
+        }
+        if (fds.empty()) {
+            std::cerr << "Error: All worker processes died" << std::endl;
+            stop_workers(true);
+            return false;
+        }
+        if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) {
+            // the tiles still out are lost, so there is no image to save
+            std::cerr << "Error: Could not wait for the worker processes"
+                      << std::endl;
+            stop_workers(true);
+            return false;
+        }
+
+        for (int k = 0; k < fds.size(); k++) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            WorkerProcess &worker = *polled[k];
+            char buffer[1 << 16];
+            ssize_t got = read(worker.from_worker, buffer, sizeof(buffer));
+            if (got <= 0) {
+                lose_worker(worker);
+                continue;
+            }
+            // the buffer may hold the end of one message and the start of
+            // the next, or anything in between
+            for (ssize_t pos = 0; pos < got && worker.alive;) {
+                if (worker.pixel_bytes == 0) {
+                    char c = buffer[pos++];
+                    if (c != '\n') {
+                        worker.header += c;
+                        continue;
+                    }
+                    std::istringstream words(worker.header);
+                    std::string command;
+                    int id;
+                    size_t bytes;
+                    words >> command >> id >> bytes;
+                    worker.header.clear();
+                    if (command != "done" || id != worker.tile || bytes == 0) {
+                        kill(worker.pid, SIGKILL);
+                        lose_worker(worker);
+                        break;
+                    }
+                    worker.pixel_bytes = bytes;
+                    worker.pixels.clear();
+                } else {
+                    size_t take = std::min<size_t>(
+                        got - pos, worker.pixel_bytes - worker.pixels.size());
+                    worker.pixels.insert(worker.pixels.end(), buffer + pos,
+                                         buffer + pos + take);
+                    pos += take;
+                    if (worker.pixels.size() == worker.pixel_bytes) {
+                        worker.pixel_bytes = 0;
+                        finish_tile(worker);
+                    }
+                }
+            }
         }
-        for (auto &t : threads) t.join();
-    } else {
-        render_segment(0, image_width);
     }
 
-    std::string output_file =
-        "Output_1" + std::to_string(++captured_images) + ".bmp";
+    stop_workers(false);
 
     image.save_image(output_file);
     double time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
                               std::chrono::steady_clock::now() - start)
                               .count();
-    std::cout << "Image captured to " << output_file << " in "
-              << time_elapsed / 1000 << " seconds" << std::endl;
+    std::cout << "Image rendered by " << num_workers << " worker processes to "
+              << output_file << " in " << time_elapsed / 1000 << " seconds ("
+              << tiles.size() << " tiles, " << reassigned << " reassigned)"
+              << std::endl;
+    for (int i = 0; i < workers.size(); i++)
+        std::cout << "  worker " << i + 1 << ": " << workers[i].tiles_done
+                  << " tiles" << std::endl;
+    return true;
+}
+#endif
+
+// Render Service
+//
+// With --serve the program stays up and renders jobs sent to a Unix domain
+// socket, so that scenes are parsed and the worker threads started only
+// once. Every line a client sends is one request, answered by one line:
+//   render <scene file> <width> <height> <depth> <output file>
+//          <eye x y z> <look at x y z> <up x y z>
+//     -> done <output file> queue <ms> load <ms> render <ms> save <ms>
+//   stats
+//     -> stats jobs <n> scenes <n> bytes <n> queue median <ms> max <ms>
+//        render median <ms> max <ms>
+//   shutdown
+//     -> done shutdown
+// or by "error <reason>". Requests from all clients are queued and handled
+// one at a time, in the order they arrive; every render uses the whole
+// worker pool. Queue time runs from arrival to the start of the job, load
+// time is 0 when the scene was still resident. Files are relative to the
+// directory the service was started in. Options the service was started
+// with, such as --shadow-maps and --light-range, apply to every job.
+
+SceneCache::SceneCache(size_t max_bytes)
+    : max_bytes(max_bytes), used_bytes(0) {}
+
+std::string SceneCache::stamp(const std::string &file,
+                              const std::vector<std::string> &dependencies) {
+    // the text is small enough to hash every time; meshes are judged by
+    // size and modification time
+    std::string result = std::to_string(hash_file(file));
+    for (const std::string &dependency : dependencies) {
+        struct stat info;
+        if (stat(dependency.c_str(), &info) != 0) {
+            result += " -";
+            continue;
+        }
+        result += " " + std::to_string((long long)info.st_size) + "@" +
+                  std::to_string((long long)info.st_mtime);
+    }
+    return result;
+}
+
+const Scene *SceneCache::get(const std::string &file, bool &loaded) {
+    loaded = false;
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->file != file) continue;
+        if (it->stamp == stamp(file, it->scene->dependencies)) {
+            entries.splice(entries.begin(), entries, it);
+            return entries.front().scene.get();
+        }
+        used_bytes -= it->bytes;
+        entries.erase(it);
+        break;
+    }
+
+    std::unique_ptr<Scene> scene = load_scene(file);
+    if (scene->objects.empty()) return nullptr;
+    loaded = true;
+    Entry entry;
+    entry.file = file;
+    entry.stamp = stamp(file, scene->dependencies);
+    entry.bytes = scene->memory_used();
+    entry.scene = std::move(scene);
+    used_bytes += entry.bytes;
+    entries.push_front(std::move(entry));
+    while (used_bytes > max_bytes && entries.size() > 1) {
+        used_bytes -= entries.back().bytes;
+        entries.pop_back();
+    }
+    return entries.front().scene.get();
+}
+
+int SceneCache::size() const { return entries.size(); }
+
+size_t SceneCache::bytes() const { return used_bytes; }
+
+#ifdef WIN32
+bool run_service(const std::string &socket_path, size_t cache_bytes) {
+    std::cerr << "Error: The render service needs a POSIX system" << std::endl;
+    return false;
+}
+
+bool submit_jobs(const std::string &socket_path) {
+    std::cerr << "Error: The render service needs a POSIX system" << std::endl;
+    return false;
+}
+#else
+namespace {
+
+// A connection to the service. The socket is closed once neither the
+// reading loop nor a queued request refers to it any more, so replies still
+// reach a client that has shut down its side after sending.
+struct ServiceClient {
+    int fd;
+    std::string partial;  // received after the last complete line
+    ~ServiceClient() { close(fd); }
+};
+
+struct ServiceRequest {
+    std::shared_ptr<ServiceClient> client;
+    std::string line;
+    std::chrono::steady_clock::time_point received;
+};
+
+bool write_all(int fd, const std::string &text) {
+    const char *data = text.c_str();
+    size_t left = text.size();
+    while (left > 0) {
+        ssize_t written = write(fd, data, left);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data += written;
+        left -= written;
+    }
+    return true;
+}
+
+bool make_socket_address(const std::string &socket_path, sockaddr_un &address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: Socket path must be 1 to "
+                  << sizeof(address.sun_path) - 1 << " characters"
+                  << std::endl;
+        return false;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    return true;
+}
+
+double median(std::vector<double> values) {
+    if (values.empty()) return 0;
+    std::nth_element(values.begin(), values.begin() + values.size() / 2,
+                     values.end());
+    return values[values.size() / 2];
+}
+
+double milliseconds_between(std::chrono::steady_clock::time_point from,
+                            std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+}  // namespace
+
+bool run_service(const std::string &socket_path, size_t cache_bytes) {
+    signal(SIGPIPE, SIG_IGN);  // a client that left shows up as a failed write
+    sockaddr_un address;
+    if (!make_socket_address(socket_path, address)) return false;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "Error: Could not create a socket" << std::endl;
+        return false;
+    }
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+    // a socket file nobody listens on is left over from an earlier run
+    if (connect(listener, (sockaddr *)&address, sizeof(address)) == 0) {
+        std::cerr << "Error: A service is already listening on "
+                  << socket_path << std::endl;
+        close(listener);
+        return false;
+    }
+    close(listener);
+    unlink(socket_path.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 ||
+        bind(listener, (sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, 16) != 0) {
+        std::cerr << "Error: Could not listen on " << socket_path << std::endl;
+        if (listener >= 0) close(listener);
+        return false;
+    }
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+    std::cout << "Serving renders on " << socket_path << " with "
+              << get_worker_pool().size() << " threads and a "
+              << cache_bytes / (1 << 20) << " MB scene cache" << std::endl;
+
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::deque<ServiceRequest> requests;
+    std::atomic<bool> stopping(false);
+
+    // requests are handled here, on one thread, while the loop below keeps
+    // accepting and reading so that queue times are measured from arrival
+    std::thread handler([&] {
+        SceneCache cache(cache_bytes);
+        std::vector<double> queue_times, render_times;  // in milliseconds
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [&] { return !requests.empty(); });
+            ServiceRequest request = std::move(requests.front());
+            requests.pop_front();
+            lock.unlock();
+
+            std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+            double queue_time = milliseconds_between(request.received, start);
+            std::istringstream words(request.line);
+            std::string command, reply;
+            words >> command;
+            if (command == "render") {
+                std::string scene_file, output_file;
+                int width = 0, height = 0, depth = -1;
+                Vector eye, look_at, up;
+                words >> scene_file >> width >> height >> depth >>
+                    output_file >> eye >> look_at >> up;
+                bool loaded = false;
+                const Scene *job_scene = nullptr;
+                if (!words || width <= 0 || height <= 0 || depth < 0) {
+                    reply = "error malformed render request";
+                } else if (!(job_scene = cache.get(scene_file, loaded))) {
+                    reply = "error cannot load " + scene_file;
+                } else if (!std::ofstream(output_file, std::ios::app)) {
+                    reply = "error cannot write " + output_file;
+                } else {
+                    std::chrono::steady_clock::time_point loaded_at =
+                        std::chrono::steady_clock::now();
+                    reflection_depth = depth;
+                    View view(Camera(eye, look_at, up, camera.speed,
+                                     camera.rotation_speed),
+                              width, height, view_angle);
+                    bitmap_image image(width, height);
+                    image.set_all_channels(0, 0, 0);
+                    render_image(*job_scene, view, image);
+                    std::chrono::steady_clock::time_point rendered_at =
+                        std::chrono::steady_clock::now();
+                    image.save_image(output_file);
+                    std::chrono::steady_clock::time_point saved_at =
+                        std::chrono::steady_clock::now();
+
+                    double render_time =
+                        milliseconds_between(loaded_at, rendered_at);
+                    queue_times.push_back(queue_time);
+                    render_times.push_back(render_time);
+                    std::ostringstream text;
+                    text << "done " << output_file << " queue " << queue_time
+                         << " load "
+                         << (loaded ? milliseconds_between(start, loaded_at)
+                                    : 0.0)
+                         << " render " << render_time << " save "
+                         << milliseconds_between(rendered_at, saved_at);
+                    reply = text.str();
+                }
+            } else if (command == "stats") {
+                std::ostringstream text;
+                text << "stats jobs " << render_times.size() << " scenes "
+                     << cache.size() << " bytes " << cache.bytes()
+                     << " queue median " << median(queue_times) << " max "
+                     << (queue_times.empty()
+                             ? 0.0
+                             : *std::max_element(queue_times.begin(),
+                                                 queue_times.end()))
+                     << " render median " << median(render_times) << " max "
+                     << (render_times.empty()
+                             ? 0.0
+                             : *std::max_element(render_times.begin(),
+                                                 render_times.end()));
+                reply = text.str();
+            } else if (command == "shutdown") {
+                reply = "done shutdown";
+            } else {
+                reply = "error unknown request " + command;
+            }
+            std::cout << reply << std::endl;
+            write_all(request.client->fd, reply + "\n");
+            if (command == "shutdown") {
+                stopping = true;
+                return;
+            }
+        }
+    });
+
+    std::vector<std::shared_ptr<ServiceClient>> clients;
+    auto queue_line = [&](const std::shared_ptr<ServiceClient> &client,
+                          const std::string &line) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        requests.push_back(
+            ServiceRequest{client, line, std::chrono::steady_clock::now()});
+        queued.notify_one();
+    };
+    while (!stopping) {
+        std::vector<pollfd> fds = {pollfd{listener, POLLIN, 0}};
+        for (const std::shared_ptr<ServiceClient> &client : clients)
+            fds.push_back(pollfd{client->fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) {
+            std::cerr << "Error: Could not wait for clients" << std::endl;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                clients.push_back(std::make_shared<ServiceClient>());
+                clients.back()->fd = fd;
+            }
+        }
+        std::vector<std::shared_ptr<ServiceClient>> open;
+        for (int k = 1; k < fds.size(); k++) {
+            std::shared_ptr<ServiceClient> &client = clients[k - 1];
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                open.push_back(client);
+                continue;
+            }
+            char buffer[1 << 12];
+            ssize_t got = read(client->fd, buffer, sizeof(buffer));
+            if (got <= 0) {
+                // the last line may come without its newline
+                queue_line(client, client->partial);
+                continue;
+            }
+            client->partial.append(buffer, got);
+            size_t newline;
+            while ((newline = client->partial.find('\n')) !=
+                   std::string::npos) {
+                queue_line(client, client->partial.substr(0, newline));
+                client->partial.erase(0, newline + 1);
+            }
+            open.push_back(client);
+        }
+        for (size_t k = fds.size() - 1; k < clients.size(); k++)
+            open.push_back(clients[k]);  // accepted during this round
+        clients = std::move(open);
+    }
+
+    // stopping is only set by a shutdown request, so otherwise poll failed
+    bool shut_down = stopping;
+    if (!shut_down) {
+        // the handler still has to be told to finish
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<ServiceClient> nobody(new ServiceClient{-1, ""});
+        requests.push_back(ServiceRequest{nobody, "shutdown",
+                                          std::chrono::steady_clock::now()});
+        queued.notify_one();
+    }
+    handler.join();
+    close(listener);
+    unlink(socket_path.c_str());
+    return shut_down;
+}
+
+bool submit_jobs(const std::string &socket_path) {
+    // sends stdin as is and prints the replies until the service has
+    // answered every line
+    sockaddr_un address;
+    if (!make_socket_address(socket_path, address)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+        std::cerr << "Error: No service listening on " << socket_path
+                  << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::string line;
+    while (std::getline(std::cin, line))
+        if (!write_all(fd, line + "\n")) break;
+    shutdown(fd, SHUT_WR);
+    char buffer[1 << 12];
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+        std::cout.write(buffer, got);
+    std::cout.flush();
+    close(fd);
+    return true;
+}
+#endif
+
+// Regression Harness
+//
+// Renders each reference scene of a manifest with the default camera and
+// compares it to a golden image by PSNR, and its render time to the golden
+// time. Times are multiples of a fixed calibration workload timed alongside
+// the render, so a faster, slower or busier machine moves both alike. A
+// speed feature passes only if it keeps the image within min_psnr of the
+// golden one and is not slower than max_slowdown times the golden time.
+// With update set, the goldens are rewritten from the current renders.
+// A case may end with options that only make rendering faster
+// (--shadow-maps); it is checked against the golden image rendered without
+// them, and its max_slowdown is the allowed ratio to the time of that same
+// render without them in this run, so below 1 asks for a speedup.
+
+namespace {
+
+struct RegressionCase {
+    std::string scene_file;
+    int width, height;
+    double min_psnr;      // in dB, over the whole image
+    // allowed ratio of render time to the golden time, or with options to
+    // the time without them in the same run
+    double max_slowdown;
+    int shadow_map_resolution;  // --shadow-maps, 0 for none
+};
+
+// a run repeats the work for at least min_run_seconds, so that small cases
+// are not timed on a scale the scheduler's noise swamps; returns the time of
+// one repetition
+const int timing_runs = 5;
+const double min_run_seconds = 0.1;
+
+template <typename Work>
+double time_run(Work work) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    int repetitions = 0;
+    double elapsed;
+    do {
+        work();
+        repetitions++;
+        elapsed = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    } while (elapsed < min_run_seconds);
+    return elapsed / repetitions;
+}
+
+// A fixed workload that does not use the renderer: ray-sphere tests by hand
+// over a table of spheres, with the renderer's mix of square roots,
+// divisions and memory reads. Changes to the renderer do not move its time,
+// but the machine's speed and load do, much as they move a render's.
+void calibration_round(const std::vector<double> &spheres, double &sink) {
+    for (int r = 0; r < 64; r++) {
+        double dx = 0.3 + r * 1e-3, dy = 0.5, dz = 0.8 - r * 1e-3;
+        double inverse = 1 / sqrt(dx * dx + dy * dy + dz * dz);
+        dx *= inverse, dy *= inverse, dz *= inverse;
+        for (size_t k = 0; k + 3 < spheres.size(); k += 4) {
+            const double *s = &spheres[k];
+            double b = dx * s[0] + dy * s[1] + dz * s[2];
+            double c = s[0] * s[0] + s[1] * s[1] + s[2] * s[2] - s[3];
+            double d = b * b - c;
+            if (d > 0) sink += (b - sqrt(d)) / (1 + s[3]);
+        }
+    }
+}
+
+// The render time of the view in seconds, and returned as a multiple of the
+// calibration workload's time. Runs of the two take turns, so both see the
+// machine in the same state, and each takes its best run, so that one slow
+// run on a busy machine does not fail.
+double timed_render(const Scene &scene, const View &view, bitmap_image &image,
+                    double &seconds) {
+    std::vector<double> spheres(4 << 14);
+    for (int k = 0; k < spheres.size(); k++)
+        spheres[k] = (k * 7919 % 1000) / 1e2;
+    double sink = 0, best_calibration = 1e18;
+    seconds = 1e18;
+    for (int run = 0; run < timing_runs; run++) {
+        best_calibration =
+            std::min(best_calibration,
+                     time_run([&] { calibration_round(spheres, sink); }));
+        seconds = std::min(seconds, time_run([&] {
+                               image.set_all_channels(0, 0, 0);
+                               render_image(scene, view, image);
+                           }));
+    }
+    // keeps the calibration from being optimized away
+    volatile double result = sink;
+    (void)result;
+    return seconds / best_calibration;
 }
 
-void free_memory() {
-    for (Object *object : objects) delete object;
-    objects.clear();
+}  // namespace
+
+bool run_regression(const std::string &manifest_file, bool update) {
+    std::ifstream manifest(manifest_file);
+    std::string golden_dir;
+    int num_cases = 0;
+    manifest >> golden_dir >> num_cases;
+    std::vector<RegressionCase> cases(std::max(0, num_cases));
+    bool options_ok = true;
+    for (RegressionCase &c : cases) {
+        manifest >> c.scene_file >> c.width >> c.height >> c.min_psnr >>
+            c.max_slowdown;
+        c.shadow_map_resolution = 0;
+        std::string options, option;
+        std::getline(manifest, options);
+        std::istringstream words(options);
+        while (words >> option) {
+            if (option == "--shadow-maps" &&
+                words >> c.shadow_map_resolution &&
+                c.shadow_map_resolution > 0)
+                continue;
+            std::cerr << "Error: Unknown option " << option << " for "
+                      << c.scene_file << std::endl;
+            options_ok = false;
+            break;
+        }
+    }
+    if (!manifest || cases.empty() || !options_ok) {
+        std::cerr << "Error reading regression file " << manifest_file
+                  << std::endl;
+        return false;
+    }
+    golden_dir = resolve_path(manifest_file, golden_dir);
+    std::string timings_file = golden_dir + "/timings.txt";
+
+    // golden render times, one "<name> <multiple>" per line, in multiples
+    // of the calibration workload's time (see timed_render)
+    std::map<std::string, double> golden_times;
+    std::ifstream timings(timings_file);
+    std::string name;
+    double multiple;
+    while (timings >> name >> multiple) golden_times[name] = multiple;
+    timings.close();
+
+    // hierarchical_psnr indexes the colormap with up to 1000 when a block is
+    // as different as it can be
+    rgb_t diff_colormap[1001];
+    std::copy(jet_colormap, jet_colormap + 1000, diff_colormap);
+    diff_colormap[1000] = jet_colormap[999];
 
-    for (LightSource *light : light_sources) delete light;
-    light_sources.clear();
+    // this run's times of the cases without options, by name, as multiples
+    std::map<std::string, double> plain_times;
+    // loads the scene with shadow maps of the given resolution and times
+    // it (see timed_render), false if it failed; a --shadow-maps given to
+    // the check itself applies to every case without one
+    auto render_case = [&](const std::string &scene_file, int resolution,
+                           bitmap_image &image, double &time,
+                           double &seconds) {
+        int global_resolution = shadow_map_resolution;
+        if (resolution > 0) shadow_map_resolution = resolution;
+        load_data(scene_file);
+        shadow_map_resolution = global_resolution;
+        if (scene->objects.empty()) return false;
+        time = timed_render(*scene,
+                            View(camera, image.width(), image.height(),
+                                 view_angle),
+                            image, seconds);
+        return true;
+    };
+
+    int failures = 0;
+    for (const RegressionCase &c : cases) {
+        std::string scene_file = resolve_path(manifest_file, c.scene_file);
+        std::string stem = c.scene_file.substr(
+            c.scene_file.find_last_of("/\\") + 1);
+        stem = stem.substr(0, stem.find_last_of('.'));
+        name = stem + "_" + std::to_string(c.width) + "x" +
+               std::to_string(c.height);
+        std::string golden_file = golden_dir + "/" + name + ".bmp";
+        std::string plain_name = name;
+        bool has_options = c.shadow_map_resolution > 0;
+        if (has_options)
+            name += "_shadow-maps" + std::to_string(c.shadow_map_resolution);
+        if (update && has_options) {
+            std::cout << name << ": timed against " << plain_name
+                      << " in each run, nothing to update" << std::endl;
+            continue;
+        }
+
+        bitmap_image image(c.width, c.height);
+        double time = 0, seconds = 0, reference_time = 0;
+        if (!render_case(scene_file, c.shadow_map_resolution, image, time,
+                         seconds)) {
+            failures++;
+            continue;
+        }
+        if (!has_options) {
+            plain_times[name] = time;
+        } else {
+            // timed against the same machine as it is now, not a golden
+            if (!plain_times.count(plain_name)) {
+                bitmap_image plain(c.width, c.height);
+                double plain_time, plain_seconds;
+                if (!render_case(scene_file, 0, plain, plain_time,
+                                 plain_seconds)) {
+                    failures++;
+                    continue;
+                }
+                plain_times[plain_name] = plain_time;
+            }
+            reference_time = plain_times[plain_name];
+        }
+
+        if (update) {
+            image.save_image(golden_file);
+            golden_times[name] = time;
+            std::cout << name << ": golden image and time (" << time
+                      << "x calibration, " << seconds
+                      << " s) updated" << std::endl;
+            continue;
+        }
+        if (!has_options && golden_times.count(name))
+            reference_time = golden_times[name];
+
+        bitmap_image golden(golden_file);
+        if (!golden) {
+            std::cout << name << ": FAIL, no golden image " << golden_file
+                      << std::endl;
+            failures++;
+            continue;
+        }
+        double psnr = golden.psnr(image);
+        bool quality_ok = psnr >= c.min_psnr;
+        bool speed_ok =
+            reference_time == 0 || time <= c.max_slowdown * reference_time;
+
+        std::cout << name << ": PSNR ";
+        if (psnr >= 1000000.0) std::cout << "identical";
+        else std::cout << psnr << " dB";
+        std::cout << " (min " << c.min_psnr << "), " << seconds << " s, "
+                  << time << "x calibration";
+        if (reference_time > 0)
+            std::cout << " vs " << reference_time << "x "
+                      << (has_options ? "without options" : "golden")
+                      << " (max " << c.max_slowdown << "x)";
+        std::cout << (quality_ok && speed_ok ? ", ok" : ", FAIL") << std::endl;
+
+        if (!quality_ok) {
+            // blocks below the threshold painted over the render, hotter
+            // for a larger loss
+            std::string diff_file = name + "_diff.bmp";
+            hierarchical_psnr(golden, image, c.min_psnr, diff_colormap);
+            image.save_image(diff_file);
+            std::cout << "  regions below " << c.min_psnr << " dB marked in "
+                      << diff_file << std::endl;
+        }
+        if (!quality_ok || !speed_ok) failures++;
+    }
+    free_memory();
+
+    if (update) {
+        std::ofstream out(timings_file);
+        for (const auto &entry : golden_times)
+            out << entry.first << " " << entry.second << "\n";
+        if (!out) {
+            std::cerr << "Error: Could not write " << timings_file
+                      << std::endl;
+            return false;
+        }
+        return true;
+    }
+    std::cout << cases.size() - failures << " of " << cases.size()
+              << " reference scenes passed" << std::endl;
+    return failures == 0;
 }
 
+void free_memory() { scene.reset(); }
+
 void load_data(const std::string &filename) {
+    // The new scene replaces the current one only once it is complete; if
+    // loading fails it is left empty
+    scene = load_scene(filename);
+    get_reprojection_cache().invalidate();
+
+    if (forced_width > 0 && forced_height > 0) {
+        image_width = forced_width;
+        image_height = forced_height;
+    }
+}
+
+std::unique_ptr<Scene> load_scene(const std::string &filename) {
+    // The binary cache is only trusted if it was written for exactly this
+    // scene text; otherwise parse the text and refresh the cache
+    std::string cache_file = filename + ".cache";
+    uint64_t content_hash = hash_file(filename);
+    std::unique_ptr<Scene> loaded(new Scene);
+    int pixel;
+    if (use_scene_cache && load_scene_cache(*loaded, cache_file, content_hash,
+                                            reflection_depth, pixel)) {
+        image_width = image_height = pixel;
+    } else {
+        loaded->clear();
+        if (load_scene_text(*loaded, filename)) {
+            loaded->build_index();
+            if (use_scene_cache &&
+                !save_scene_cache(*loaded, cache_file, content_hash,
+                                  reflection_depth, image_width))
+                std::cerr << "Warning: Could not write scene cache "
+                          << cache_file << std::endl;
+        } else {
+            loaded->clear();
+        }
+    }
+    loaded->light_range = light_range;
+    loaded->select_shading();
+    if (shadow_map_resolution > 0 || use_hybrid_primary)
+        loaded->build_tessellation();
+    if (shadow_map_resolution > 0)
+        loaded->build_shadow_maps(shadow_map_resolution);
+    return loaded;
+}
+
+std::string resolve_path(const std::string &scene_file,
+                         const std::string &path) {
+    // relative paths inside a scene are relative to the scene file
+    size_t slash = scene_file.find_last_of("/\\");
+    if (slash == std::string::npos || path.empty() || path[0] == '/')
+        return path;
+    return scene_file.substr(0, slash + 1) + path;
+}
+
+bool load_scene_text(Scene &scene, const std::string &filename) {
+    std::vector<Object *> &objects = scene.objects;
+    std::vector<LightSource *> &light_sources = scene.light_sources;
+    Arena &arena = scene.arena;
+
     std::ifstream file(filename);
     if (!file.is_open()) {
         std::cerr << "Error: File not found" << std::endl;
-        return;
+        return false;
     }
 
     int pixel;
@@ -162,6 +2775,9 @@ void load_data(const std::string &filename) {
     int num_objects;
     file >> num_objects;
 
+    // every instance of the same file shares one prototype mesh
+    std::map<std::string, const Mesh *> prototypes;
+
     for (int i = 0; i < num_objects; i++) {
         std::string type;
         file >> type;
@@ -176,7 +2792,7 @@ void load_data(const std::string &filename) {
             int shine;
             file >> shine;
             Vector center(x, y, z);
-            Object *temp = new Sphere(center, radius);
+            Object *temp = arena.create<Sphere>(center, radius);
             temp->set_color(r, g, b);
             temp->set_coefficients(ambient, diffuse, specular, reflection);
             temp->set_shine(shine);
@@ -191,7 +2807,7 @@ void load_data(const std::string &filename) {
             file >> ambient >> diffuse >> specular >> reflection;
             int shine;
             file >> shine;
-            Object *temp = new Triangle(p1, p2, p3);
+            Object *temp = arena.create<Triangle>(p1, p2, p3);
             temp->set_color(r, g, b);
             temp->set_coefficients(ambient, diffuse, specular, reflection);
             temp->set_shine(shine);
@@ -210,9 +2826,9 @@ void load_data(const std::string &filename) {
             int shine;
             file >> shine;
             Vector reference_point(x, y, z);
-            Object *temp = new GeneralQuadraticSurface(A, B, C, D, E, F, G, H,
-                                                       I, J, reference_point,
-                                                       length, width, height);
+            Object *temp = arena.create<GeneralQuadraticSurface>(
+                A, B, C, D, E, F, G, H, I, J, reference_point, length, width,
+                height);
             temp->set_color(r, g, b);
             temp->set_coefficients(ambient, diffuse, specular, reflection);
             temp->set_shine(shine);
@@ -230,20 +2846,76 @@ void load_data(const std::string &filename) {
             file >> shine;
             double red_ri, green_ri, blue_ri;
             file >> red_ri >> green_ri >> blue_ri;
-            Object *temp = new Prism(a, b, c, d, e, f);
+            Object *temp = arena.create<Prism>(a, b, c, d, e, f);
             temp->set_color(red, green, blue);
             temp->set_coefficients(ambient, diffuse, specular, reflection);
             temp->set_shine(shine);
             temp->set_refractive_indices(red_ri, green_ri, blue_ri);
             objects.push_back(temp);
+        } else if (type == "mesh") {
+            std::string path;
+            file >> path;
+            path = resolve_path(filename, path);
+            double r, g, b;
+            file >> r >> g >> b;
+            double ambient, diffuse, specular, reflection;
+            file >> ambient >> diffuse >> specular >> reflection;
+            int shine;
+            file >> shine;
+            Object *temp = Mesh::load(path, arena);
+            if (temp == nullptr) {
+                std::cerr << "Error reading file: Could not load mesh " << path
+                          << std::endl;
+                return false;
+            }
+            temp->set_color(r, g, b);
+            temp->set_coefficients(ambient, diffuse, specular, reflection);
+            temp->set_shine(shine);
+            objects.push_back(temp);
+            scene.dependencies.push_back(path);
+        } else if (type == "instance") {
+            std::string path;
+            file >> path;
+            path = resolve_path(filename, path);
+            Matrix transform;
+            file >> transform;
+            double r, g, b;
+            file >> r >> g >> b;
+            double ambient, diffuse, specular, reflection;
+            file >> ambient >> diffuse >> specular >> reflection;
+            int shine;
+            file >> shine;
+            const Mesh *&prototype = prototypes[path];
+            if (prototype == nullptr) {
+                prototype = Mesh::load(path, arena);
+                if (prototype == nullptr) {
+                    std::cerr << "Error reading file: Could not load mesh "
+                              << path << std::endl;
+                    return false;
+                }
+                scene.dependencies.push_back(path);
+            }
+            Object *temp;
+            try {
+                temp = arena.create<Instance>(prototype, transform);
+            } catch (const std::invalid_argument &) {
+                std::cerr << "Error reading file: Instance transform is "
+                             "singular"
+                          << std::endl;
+                return false;
+            }
+            temp->set_color(r, g, b);
+            temp->set_coefficients(ambient, diffuse, specular, reflection);
+            temp->set_shine(shine);
+            objects.push_back(temp);
         } else {
             std::cerr << "Error reading file: Unknown object type" << std::endl;
-            return;
+            return false;
         }
     }
 
     // The Floor
-    Object *floor = new Floor(1000, 20);
+    Object *floor = arena.create<Floor>(1000, 20);
     floor->set_coefficients(0.4, 0.2, 0.2, 0.2);
     floor->set_shine(1);
     objects.push_back(floor);
@@ -257,7 +2929,7 @@ void load_data(const std::string &filename) {
         double r, g, b;
         file >> r >> g >> b;
         Vector position(x, y, z);
-        LightSource *pl = new PointLight(position, r, g, b);
+        LightSource *pl = arena.create<PointLight>(position, r, g, b);
         light_sources.push_back(pl);
     }
 
@@ -275,14 +2947,64 @@ void load_data(const std::string &filename) {
         double angle;
         file >> angle;
         Vector direction(direction_x, direction_y, direction_z);
-        LightSource *sl = new SpotLight(position, r, g, b, direction, angle);
+        LightSource *sl =
+            arena.create<SpotLight>(position, r, g, b, direction, angle);
         light_sources.push_back(sl);
     }
 
     file.close();
+    return true;
+}
+
+void draw_preview() {
+    // traced at the window size, and only again once the camera has moved
+    static std::string shown;
+    static std::vector<unsigned char> pixels;
+    int width = glutGet(GLUT_WINDOW_WIDTH);
+    int height = glutGet(GLUT_WINDOW_HEIGHT);
+    std::string current = format_camera(camera) + " " +
+                          std::to_string(width) + " " + std::to_string(height);
+    if (current != shown) {
+        bitmap_image frame(width, height);
+        View view(camera, width, height, view_angle);
+        get_reprojection_cache().render(*scene, view, frame);
+
+        // OpenGL wants RGB with the bottom row first
+        pixels.resize(3 * width * height);
+        for (int j = 0; j < height; j++) {
+            const unsigned char *bgr = frame.row(height - 1 - j);
+            unsigned char *rgb = &pixels[3 * width * j];
+            for (int i = 0; i < width; i++) {
+                rgb[3 * i] = bgr[3 * i + 2];
+                rgb[3 * i + 1] = bgr[3 * i + 1];
+                rgb[3 * i + 2] = bgr[3 * i];
+            }
+        }
+        shown = current;
+    }
+
+    glDisable(GL_DEPTH_TEST);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glRasterPos2f(-1, -1);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glDrawPixels(width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
 }
 
 void display() {
+    if (raytraced_preview && scene) {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        draw_preview();
+        glutSwapBuffers();
+        return;
+    }
+
     glEnable(GL_DEPTH_TEST);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glMatrixMode(GL_MODELVIEW);
@@ -292,7 +3014,8 @@ void display() {
               camera.pos.z + camera.look.z, camera.up.x, camera.up.y,
               camera.up.z);
     // draw_axes();
-    for (Object *they : objects) they->draw();
+    if (scene)
+        for (Object *they : scene->objects) they->draw();
     // for (LightSource *light : light_sources) light->draw();
     glutSwapBuffers();
 }
@@ -332,6 +3055,10 @@ void handle_keys(unsigned char key, int x, int y) {
             printf("Camera Position: (%.2lf, %.2lf, %.2lf)\n", camera.pos.x,
                    camera.pos.y, camera.pos.z);
             break;
+        case 'r':
+            raytraced_preview = !raytraced_preview;
+            printf("Ray traced preview %s\n", raytraced_preview ? "on" : "off");
+            break;
         default:
             printf("Unknown key pressed\n");
             break;
@@ -365,8 +3092,138 @@ void handle_special_keys(int key, int x, int y) {
 }
 
 int main(int argc, char **argv) {
-    if (argc < 2) input_file = "scene.txt";
-    else input_file = argv[1];
+    // demo [scene file] [--size width height] [--threads n]
+    //      [--path camera path file [--reproject]]
+    //      [--stream output file [--band rows]]
+    //      [--distribute processes [--output file]]
+    //      [--regress regression file [--update-golden]]
+    //      [--budget milliseconds] [--shadow-maps resolution] [--hybrid]
+    //      [--wavefront] [--light-range distance]
+    //      [--serve socket [--cache-mb megabytes]] [--submit socket]
+    //      [--batch job file]
+    //      [--crop column row width height [--onto earlier capture]]
+    //      [--checkpoint file [--checkpoint-every seconds]]
+    input_file = "scene.txt";
+    program_path = argv[0];
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--path" && i + 1 < argc) {
+            camera_path_file = argv[++i];
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batch_file = argv[++i];
+        } else if (arg == "--stream" && i + 1 < argc) {
+            stream_output_file = argv[++i];
+        } else if (arg == "--band" && i + 1 < argc) {
+            stream_band_rows = atoi(argv[++i]);
+        } else if (arg == "--size" && i + 2 < argc) {
+            forced_width = atoi(argv[++i]);
+            forced_height = atoi(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            num_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--distribute" && i + 1 < argc) {
+            num_worker_processes = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--output" && i + 1 < argc) {
+            output_file_name = argv[++i];
+        } else if (arg == "--worker") {
+            run_as_worker = true;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            service_socket = argv[++i];
+        } else if (arg == "--submit" && i + 1 < argc) {
+            submit_socket = argv[++i];
+        } else if (arg == "--cache-mb" && i + 1 < argc) {
+            scene_cache_mb = std::max(0.0, atof(argv[++i]));
+        } else if (arg == "--regress" && i + 1 < argc) {
+            regression_file = argv[++i];
+        } else if (arg == "--update-golden") {
+            update_golden = true;
+        } else if (arg == "--reproject") {
+            use_reprojection = true;
+        } else if (arg == "--budget" && i + 1 < argc) {
+            render_budget_ms = atof(argv[++i]);
+        } else if (arg == "--crop" && i + 4 < argc) {
+            crop_col = atoi(argv[++i]);
+            crop_row = atoi(argv[++i]);
+            crop_width = atoi(argv[++i]);
+            crop_height = atoi(argv[++i]);
+        } else if (arg == "--onto" && i + 1 < argc) {
+            composite_file = argv[++i];
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpoint_file = argv[++i];
+        } else if (arg == "--checkpoint-every" && i + 1 < argc) {
+            checkpoint_seconds = std::max(0.0, atof(argv[++i]));
+        } else if (arg == "--shadow-maps" && i + 1 < argc) {
+            shadow_map_resolution = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--hybrid") {
+            use_hybrid_primary = true;
+        } else if (arg == "--wavefront") {
+            use_wavefront = true;
+        } else if (arg == "--light-range" && i + 1 < argc) {
+            light_range = std::max(0.0, atof(argv[++i]));
+        } else {
+            input_file = arg;
+        }
+    }
+
+    if (!camera_path_file.empty()) {
+        load_data(input_file);
+        render_animation(camera_path_file);
+        free_memory();
+        return 0;
+    }
+
+    if (!batch_file.empty()) {
+        load_data(input_file);
+        bool rendered = !scene->objects.empty() && render_batch(batch_file);
+        free_memory();
+        return rendered ? 0 : 1;
+    }
+
+    if (!service_socket.empty())
+        return run_service(service_socket, scene_cache_mb * (1 << 20)) ? 0
+                                                                         : 1;
+    if (!submit_socket.empty()) return submit_jobs(submit_socket) ? 0 : 1;
+
+    if (!regression_file.empty())
+        return run_regression(regression_file, update_golden) ? 0 : 1;
+
+    if (run_as_worker) {
+        load_data(input_file);
+        run_worker();
+        free_memory();
+        return 0;
+    }
+
+    if (num_worker_processes > 0) {
+        // only the resolution is needed here, the workers load the scene
+        std::ifstream file(input_file);
+        int pixel = 0;
+        file >> reflection_depth >> pixel;
+        image_width = forced_width > 0 ? forced_width : pixel;
+        image_height = forced_height > 0 ? forced_height : pixel;
+        if (image_width <= 0 || image_height <= 0) {
+            std::cerr << "Error: File not found" << std::endl;
+            return 1;
+        }
+        return render_distributed(num_worker_processes, output_file_name) ? 0
+                                                                          : 1;
+    }
+
+    if (!stream_output_file.empty()) {
+        load_data(input_file);
+        bool ok = render_streaming(stream_output_file, stream_band_rows);
+        free_memory();
+        return ok ? 0 : 1;
+    }
+
+    if (render_budget_ms > 0 || crop_width > 0 || !checkpoint_file.empty()) {
+        // a single capture, for previews that have to be ready in time, for
+        // a closer look at part of the image or for long renders
+        load_data(input_file);
+        bool captured = capture();
+        get_image_writer().flush();
+        free_memory();
+        return captured ? 0 : 1;
+    }
 
     glutInit(&argc, argv);
     glutInitWindowSize(768, 768);